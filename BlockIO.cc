@@ -0,0 +1,1606 @@
+#include "BlockIO.h"
+#include "Checksum.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+
+// Blocks requested by a single prefetch read
+typedef struct {
+	uint8_t start_block;
+	uint8_t count;
+	uint32_t generation[IO_BLOCK_COUNT];  // Write generation of each block when requested
+	char command[7];           // Command that requested prefetch
+	uint32_t line;
+} Prefetch;
+
+// Magic number at start of saved overlay delta
+#define IO_DELTA_MAGIC          "FSDELTA1"
+
+// Magic number at start of saved block checksums
+#define IO_SUMS_MAGIC           "FSSUMS02"
+
+// Locks guarding read-modify-write of direct I/O spans, chosen by span
+#define IO_SPAN_LOCKS           64
+
+// Smallest access to a striped volume whose parts are handed to member
+// workers, smaller accesses reach their members one after another
+#define IO_PARALLEL_MIN         (32 * 1024)
+
+// Aligned memory that grows on demand and is freed with its owner
+class Aligned_buffer
+{
+public:
+	Aligned_buffer() : data(NULL), size(0) {}
+	~Aligned_buffer() { free(data); }
+
+	/**
+	* @brief 	Get buffer of at least len bytes aligned for direct I/O
+	*/
+	uint8_t *get(size_t len)
+	{
+		if (len > size)
+		{
+			free(data);
+			if (posix_memalign((void **) &data, IO_ARENA_ALIGN, len) != 0)
+			{
+				data = NULL;
+				len = 0;
+			}
+			size = len;
+		}
+		return data;
+	}
+
+private:
+	uint8_t *data;
+	size_t size;
+};
+
+// Block buffer arena, only used by the thread executing commands
+std::vector<uint8_t *> io_arena;
+uint8_t *io_arena_zero = NULL;
+
+// Bounce buffer for direct I/O that is not aligned, one per thread
+thread_local Aligned_buffer io_bounce;
+
+// Locks held while a span of direct I/O is read, modified and written back
+std::mutex io_span_mutex[IO_SPAN_LOCKS];
+
+// Attached disk
+Io_device *io_dev = NULL;
+
+// Thread running parts of striped accesses for one member of a volume, in
+// the order they were handed to it
+typedef struct {
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque< std::function<void(void)> > jobs;
+	uint8_t stop;
+} Io_member_worker;
+
+// Workers of members past the first of each striped volume, started on its
+// first large access and stopped when it is closed. The first member is
+// accessed by the thread making the access.
+std::mutex io_members_mutex;
+std::map< Io_device *, std::vector<Io_member_worker *> > io_member_workers;
+
+// I/O trace, guarded by io_trace_mutex
+std::mutex io_trace_mutex;
+FILE *io_trace_fp = NULL;
+off_t io_trace_end = 0;
+
+// Command the accesses of each thread are recorded for
+thread_local char io_command[7];
+thread_local uint32_t io_line = 0;
+
+// Read-ahead cache, guarded by io_mutex
+std::mutex io_mutex;
+std::condition_variable io_cond;
+std::thread io_worker;
+uint8_t io_stop = 0;
+std::deque<Prefetch> io_queue;
+uint8_t io_pending[IO_BLOCK_COUNT];
+uint32_t io_generation[IO_BLOCK_COUNT];
+std::map< uint8_t, std::vector<uint8_t> > io_cache;
+std::deque<uint8_t> io_cache_order;
+
+
+/**
+* @brief 	Record disk access in I/O trace, preceded by a seek if it does not
+* 			start where the previous access ended
+* @param 	op - IO_TRACE_READ, IO_TRACE_WRITE, or IO_TRACE_DELTA or
+* 			IO_TRACE_COMMAND, which do not access the disk
+* @param 	offset - offset on disk
+* @param 	len - number of bytes
+* @param 	command - command that caused the access
+* @param 	line - line of command in input file
+*/
+void io_trace(uint8_t op, off_t offset, size_t len, const char *command, uint32_t line)
+{
+	std::lock_guard<std::mutex> lock(io_trace_mutex);
+	if (io_trace_fp == NULL)
+	{
+		return;
+	}
+
+	Io_record record;
+	memcpy(record.command, command, 7);
+	record.line = line;
+
+	if ((op == IO_TRACE_DELTA) || (op == IO_TRACE_COMMAND))
+	{
+		// Disk head does not move
+		record.op = op;
+		record.offset = offset;
+		record.length = len;
+		fwrite(&record, sizeof(Io_record), 1, io_trace_fp);
+		return;
+	}
+
+	if (offset != io_trace_end)
+	{
+		record.op = IO_TRACE_SEEK;
+		record.offset = offset;
+		record.length = (offset > io_trace_end) ? offset - io_trace_end : io_trace_end - offset;
+		fwrite(&record, sizeof(Io_record), 1, io_trace_fp);
+	}
+
+	record.op = op;
+	record.offset = offset;
+	record.length = len;
+	fwrite(&record, sizeof(Io_record), 1, io_trace_fp);
+
+	io_trace_end = offset + len;
+}
+
+
+/**
+* @brief 	Drop block from cache and bump its write generation, with
+* 			io_mutex held
+* @param 	block_num - block that was written
+*/
+void io_invalidate(uint8_t block_num)
+{
+	io_generation[block_num]++;
+	if (io_cache.erase(block_num))
+	{
+		for (std::deque<uint8_t>::iterator it = io_cache_order.begin(); it != io_cache_order.end(); it++)
+		{
+			if (*it == block_num)
+			{
+				io_cache_order.erase(it);
+				break;
+			}
+		}
+	}
+}
+
+
+/**
+* @brief 	Verify block of attached disk against its checksum, taking its
+* 			checksum if it has none yet
+* @param 	block_num - block that was read
+* @param 	buff - data of block
+* @return 	0 if block matches, 1 if checksum was taken, -1 if block is corrupt
+*/
+int io_verify(uint8_t block_num, const uint8_t *buff)
+{
+	if (io_dev->checksums == 0)
+	{
+		return 0;
+	}
+
+	uint32_t crc = crc32c(0, buff, IO_BLOCK_SIZE);
+	if (io_dev->sum_known[block_num] == 0)
+	{
+		io_dev->sum[block_num] = crc;
+		io_dev->sum_known[block_num] = 1;
+		return 1;
+	}
+
+	return (crc == io_dev->sum[block_num]) ? 0 : -1;
+}
+
+
+/**
+* @brief 	Check if access can be passed to direct I/O as is
+* @param 	buff - buffer of access
+* @param 	len - number of bytes
+* @param 	offset - offset on disk
+* @param 	align - alignment required by direct I/O, 0 for buffered I/O
+* @return 	1 if aligned, otherwise 0
+*/
+uint8_t io_aligned(const void *buff, size_t len, off_t offset, uint32_t align)
+{
+	return (align == 0) || ((((uintptr_t) buff | len | offset) & (align - 1)) == 0);
+}
+
+
+// Part of an access that falls in one member of a volume
+typedef struct {
+	size_t member;
+	off_t offset;        // Offset in member
+	size_t len;
+	size_t buff_offset;  // Offset in buffer of access
+} Io_extent;
+
+
+/**
+* @brief 	Read from image, reading the surrounding aligned span into a
+* 			bounce buffer if direct I/O requires it
+* @param 	fd - file descriptor of image
+* @param 	align - alignment required by direct I/O, 0 for buffered I/O
+* @param 	buff - buffer to read into
+* @param 	len - number of bytes
+* @param 	offset - offset in image
+* @return 	number of bytes read
+*/
+ssize_t io_member_pread(int fd, uint32_t align, void *buff, size_t len, off_t offset)
+{
+	if (io_aligned(buff, len, offset, align))
+	{
+		return pread(fd, buff, len, offset);
+	}
+
+	off_t start = offset & ~((off_t) align - 1);
+	size_t span = ((offset + len + align - 1) & ~((off_t) align - 1)) - start;
+	uint8_t *bounce = io_bounce.get(span);
+
+	ssize_t read_len = pread(fd, bounce, span, start);
+	if (read_len <= offset - start)
+	{
+		return (read_len < 0) ? read_len : 0;
+	}
+
+	size_t copy_len = ((size_t) (read_len - (offset - start)) < len) ? read_len - (offset - start) : len;
+	memcpy(buff, bounce + (offset - start), copy_len);
+	return copy_len;
+}
+
+
+/**
+* @brief 	Write to image, updating the surrounding aligned span through a
+* 			bounce buffer if direct I/O requires it
+* @param 	fd - file descriptor of image
+* @param 	align - alignment required by direct I/O, 0 for buffered I/O
+* @param 	buff - buffer to write from
+* @param 	len - number of bytes
+* @param 	offset - offset in image
+* @return 	number of bytes written
+*/
+ssize_t io_member_pwrite(int fd, uint32_t align, const void *buff, size_t len, off_t offset)
+{
+	if (io_aligned(buff, len, offset, align))
+	{
+		return pwrite(fd, buff, len, offset);
+	}
+
+	off_t start = offset & ~((off_t) align - 1);
+	size_t span = ((offset + len + align - 1) & ~((off_t) align - 1)) - start;
+	uint8_t *bounce = io_bounce.get(span);
+
+	// Worker threads write neighbouring blocks that can share a span, so
+	// every aligned unit of span is locked, in increasing lock order
+	std::set<size_t> lock_nums;
+	for (off_t unit = start; unit < start + (off_t) span; unit += align)
+	{
+		lock_nums.insert(((size_t) fd * 31 + (size_t) (unit / align)) % IO_SPAN_LOCKS);
+	}
+	std::vector< std::unique_lock<std::mutex> > locks;
+	for (std::set<size_t>::iterator it = lock_nums.begin(); it != lock_nums.end(); it++)
+	{
+		locks.push_back(std::unique_lock<std::mutex>(io_span_mutex[*it]));
+	}
+
+	// Read, modify and write back whole span
+	ssize_t read_len = pread(fd, bounce, span, start);
+	if (read_len < (ssize_t) span)
+	{
+		memset(bounce + ((read_len > 0) ? read_len : 0), 0, span - ((read_len > 0) ? read_len : 0));
+	}
+	memcpy(bounce + (offset - start), buff, len);
+
+	if (pwrite(fd, bounce, span, start) != (ssize_t) span)
+	{
+		return -1;
+	}
+	return len;
+}
+
+
+/**
+* @brief 	Split access to disk into the parts that fall in each member,
+* 			joining parts that are contiguous in the same member
+* @param 	dev - disk
+* @param 	len - number of bytes
+* @param 	offset - offset on disk
+* @param 	extents - list that will contain parts in disk order
+*/
+void io_map(Io_device *dev, size_t len, off_t offset, std::vector<Io_extent> &extents)
+{
+	off_t unit_bytes = (off_t) dev->stripe * IO_BLOCK_SIZE;
+	size_t done = 0;
+	while (done < len)
+	{
+		Io_extent extent;
+		extent.offset = io_stripe_map(offset + done, dev->stripe, dev->members.size(), &extent.member);
+		extent.len = unit_bytes - ((offset + done) % unit_bytes);
+		extent.len = (extent.len < len - done) ? extent.len : len - done;
+		extent.buff_offset = done;
+		done += extent.len;
+
+		if (!extents.empty() && (extents.back().member == extent.member) &&
+			(extents.back().offset + (off_t) extents.back().len == extent.offset))
+		{
+			extents.back().len += extent.len;
+			continue;
+		}
+		extents.push_back(extent);
+	}
+}
+
+
+/**
+* @brief 	Run parts of striped accesses handed to member worker until stopped
+* @param 	worker - worker of member
+*/
+void io_member_worker(Io_member_worker *worker)
+{
+	std::unique_lock<std::mutex> lock(worker->mutex);
+	while (1)
+	{
+		worker->cond.wait(lock, [worker] { return worker->stop || !worker->jobs.empty(); });
+		if (worker->jobs.empty())
+		{
+			return;
+		}
+
+		std::function<void(void)> job = worker->jobs.front();
+		worker->jobs.pop_front();
+		lock.unlock();
+		job();
+		lock.lock();
+	}
+}
+
+
+/**
+* @brief 	Get workers of members of striped volume, starting them if needed
+* @param 	dev - striped volume
+* @return 	worker of each member, NULL for the first member
+*/
+std::vector<Io_member_worker *> &io_start_members(Io_device *dev)
+{
+	std::lock_guard<std::mutex> lock(io_members_mutex);
+	std::vector<Io_member_worker *> &workers = io_member_workers[dev];
+	if (workers.empty())
+	{
+		workers.push_back(NULL);
+		for (size_t member = 1; member < dev->members.size(); member++)
+		{
+			Io_member_worker *worker = new Io_member_worker;
+			worker->stop = 0;
+			worker->thread = std::thread(io_member_worker, worker);
+			workers.push_back(worker);
+		}
+	}
+	return workers;
+}
+
+
+/**
+* @brief 	Stop workers of members of striped volume
+* @param 	dev - striped volume
+*/
+void io_stop_members(Io_device *dev)
+{
+	std::vector<Io_member_worker *> workers;
+	{
+		std::lock_guard<std::mutex> lock(io_members_mutex);
+		std::map< Io_device *, std::vector<Io_member_worker *> >::iterator it = io_member_workers.find(dev);
+		if (it == io_member_workers.end())
+		{
+			return;
+		}
+		workers = it->second;
+		io_member_workers.erase(it);
+	}
+
+	for (size_t member = 1; member < workers.size(); member++)
+	{
+		{
+			std::lock_guard<std::mutex> lock(workers[member]->mutex);
+			workers[member]->stop = 1;
+		}
+		workers[member]->cond.notify_one();
+		workers[member]->thread.join();
+		delete workers[member];
+	}
+}
+
+
+/**
+* @brief 	Read or write disk, with the parts of a large access that fall in
+* 			different members of a striped volume accessed in parallel
+* @param 	dev - disk
+* @param 	write - 1 to write buffer, 0 to read into it
+* @param 	buff - buffer to read into or write from
+* @param 	len - number of bytes
+* @param 	offset - offset on disk
+* @return 	number of bytes read or written before the first short access
+*/
+ssize_t io_transfer(Io_device *dev, uint8_t write, uint8_t *buff, size_t len, off_t offset)
+{
+	std::vector<Io_extent> extents;
+	io_map(dev, len, offset, extents);
+
+	if (extents.size() == 1)
+	{
+		int fd = dev->members[extents[0].member];
+		return write ? io_member_pwrite(fd, dev->align, buff, len, extents[0].offset) :
+			io_member_pread(fd, dev->align, buff, len, extents[0].offset);
+	}
+
+	std::vector<ssize_t> done(extents.size(), 0);
+	auto member_io = [dev, write, buff, &extents, &done](size_t member) {
+		for (size_t i = 0; i < extents.size(); i++)
+		{
+			if (extents[i].member == member)
+			{
+				int fd = dev->members[member];
+				uint8_t *part = buff + extents[i].buff_offset;
+				done[i] = write ? io_member_pwrite(fd, dev->align, part, extents[i].len, extents[i].offset) :
+					io_member_pread(fd, dev->align, part, extents[i].len, extents[i].offset);
+			}
+		}
+	};
+
+	if (len < IO_PARALLEL_MIN)
+	{
+		// Handing off a small access costs more than its reads or writes
+		for (size_t member = 0; member < dev->members.size(); member++)
+		{
+			member_io(member);
+		}
+	}
+	else
+	{
+		// Other members run their parts on their workers while this thread
+		// runs the parts of the first member
+		std::vector<Io_member_worker *> &workers = io_start_members(dev);
+		std::mutex done_mutex;
+		std::condition_variable done_cond;
+		size_t pending = 0;
+		std::vector<uint8_t> involved(dev->members.size(), 0);
+		for (size_t i = 0; i < extents.size(); i++)
+		{
+			if ((extents[i].member > 0) && (involved[extents[i].member] == 0))
+			{
+				involved[extents[i].member] = 1;
+				pending++;
+			}
+		}
+
+		for (size_t member = 1; member < dev->members.size(); member++)
+		{
+			if (involved[member])
+			{
+				std::lock_guard<std::mutex> lock(workers[member]->mutex);
+				workers[member]->jobs.push_back([&, member] {
+					member_io(member);
+
+					// Waiter cannot return before notify, so its condition
+					// variable is still alive
+					std::lock_guard<std::mutex> done_lock(done_mutex);
+					pending--;
+					done_cond.notify_one();
+				});
+				workers[member]->cond.notify_one();
+			}
+		}
+
+		member_io(0);
+		std::unique_lock<std::mutex> lock(done_mutex);
+		done_cond.wait(lock, [&pending] { return pending == 0; });
+	}
+
+	ssize_t total = 0;
+	for (size_t i = 0; i < extents.size(); i++)
+	{
+		if (done[i] < 0)
+		{
+			return (total > 0) ? total : -1;
+		}
+		total += done[i];
+		if ((size_t) done[i] < extents[i].len)
+		{
+			break;
+		}
+	}
+	return total;
+}
+
+
+/**
+* @brief 	Read from disk on behalf of current command
+* @param 	dev - disk
+* @param 	buff - buffer to read into
+* @param 	len - number of bytes
+* @param 	offset - offset on disk
+* @return 	number of bytes read
+*/
+ssize_t io_pread(Io_device *dev, void *buff, size_t len, off_t offset)
+{
+	io_trace(IO_TRACE_READ, offset, len, io_command, io_line);
+	return io_transfer(dev, 0, (uint8_t *) buff, len, offset);
+}
+
+
+/**
+* @brief 	Write to disk on behalf of current command
+* @param 	dev - disk
+* @param 	buff - buffer to write from
+* @param 	len - number of bytes
+* @param 	offset - offset on disk
+* @return 	number of bytes written
+*/
+ssize_t io_pwrite(Io_device *dev, const void *buff, size_t len, off_t offset)
+{
+	io_trace(IO_TRACE_WRITE, offset, len, io_command, io_line);
+	return io_transfer(dev, 1, (uint8_t *) buff, len, offset);
+}
+
+
+/**
+* @brief 	Read prefetch requests from queue into cache until stopped
+*/
+void io_prefetch_worker(void)
+{
+	Aligned_buffer prefetch_buff;
+	std::unique_lock<std::mutex> lock(io_mutex);
+
+	while (1)
+	{
+		io_cond.wait(lock, [] { return io_stop || !io_queue.empty(); });
+		if (io_queue.empty())
+		{
+			return;
+		}
+
+		Prefetch request = io_queue.front();
+		io_queue.pop_front();
+
+		// Contiguous blocks are read with a single read
+		size_t buff_len = request.count * IO_BLOCK_SIZE;
+		uint8_t *buff = prefetch_buff.get(buff_len);
+		lock.unlock();
+		io_trace(IO_TRACE_READ, request.start_block * IO_BLOCK_SIZE, buff_len, request.command, request.line);
+		ssize_t len = io_transfer(io_dev, 0, buff, buff_len, request.start_block * IO_BLOCK_SIZE);
+		lock.lock();
+
+		for (uint8_t i = 0; i < request.count; i++)
+		{
+			uint8_t block_num = request.start_block + i;
+			io_pending[block_num] = 0;
+
+			// Drop blocks that were written while being read
+			if ((len < (i + 1) * IO_BLOCK_SIZE) || (request.generation[block_num] != io_generation[block_num]))
+			{
+				continue;
+			}
+
+			if (io_cache.find(block_num) == io_cache.end())
+			{
+				// Evict oldest block when cache is full
+				while (io_cache.size() >= IO_CACHE_BLOCKS)
+				{
+					io_cache.erase(io_cache_order.front());
+					io_cache_order.pop_front();
+				}
+				io_cache_order.push_back(block_num);
+			}
+			// Blocks modified in overlay are taken from delta instead of disk
+			std::map< uint8_t, std::vector<uint8_t> >::iterator it = io_dev->delta.find(block_num);
+			if (it != io_dev->delta.end())
+			{
+				io_cache[block_num] = it->second;
+			}
+			else
+			{
+				io_cache[block_num].assign(buff + (i * IO_BLOCK_SIZE), buff + ((i + 1) * IO_BLOCK_SIZE));
+			}
+		}
+
+		io_cond.notify_all();
+	}
+}
+
+
+/**
+* @brief 	Read list of members of striped volume from volume descriptor
+* @param 	name - name of file that may be a volume descriptor
+* @param 	stripe - blocks per stripe unit
+* @param 	members - list that will contain name of each member
+* @return 	1 if file is a valid descriptor, 0 if it is not a descriptor,
+* 			otherwise -1
+*/
+int io_read_volume(const char *name, uint32_t *stripe, std::vector<std::string> &members)
+{
+	FILE *fp = fopen(name, "r");
+	if (fp == NULL)
+	{
+		return 0;
+	}
+
+	// Block 0 of a disk is always used, so a disk never starts with the magic
+	char line[256];
+	if ((fgets(line, sizeof(line), fp) == NULL) || (strncmp(line, IO_VOLUME_MAGIC, 8) != 0))
+	{
+		fclose(fp);
+		return 0;
+	}
+
+	// Members are found next to descriptor unless their path is absolute
+	std::string dir(name);
+	dir.erase(dir.find_last_of('/') + 1);
+
+	int valid = 1;
+	*stripe = IO_STRIPE_BLOCKS;
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		line[strcspn(line, "\n")] = 0;
+		int value;
+		if ((line[0] == 0) || (line[0] == '#'))
+		{
+			continue;
+		}
+		else if (sscanf(line, "stripe %d", &value) == 1)
+		{
+			valid &= (value > 0) && (value <= (int) IO_BLOCK_COUNT);
+			*stripe = value;
+		}
+		else if ((strncmp(line, "member ", 7) == 0) && (line[7] != 0))
+		{
+			members.push_back((line[7] == '/') ? std::string(line + 7) : dir + (line + 7));
+		}
+		else
+		{
+			valid = 0;
+		}
+	}
+	fclose(fp);
+
+	return (valid && !members.empty() && (members.size() <= IO_MAX_MEMBERS)) ? 1 : -1;
+}
+
+
+/**
+* @brief 	Open image of disk or of member of striped volume
+* @param 	name - name of image
+* @param 	flags - open flags
+* @param 	direct - 1 to bypass page cache
+* @param 	align - alignment required by direct I/O, raised to that of image
+* @return 	file descriptor, -1 if image cannot be opened
+*/
+int io_open_image(const char *name, int flags, uint8_t direct, uint32_t *align)
+{
+	int fd = direct ? open(name, flags | O_DIRECT) : -1;
+	if (fd >= 0)
+	{
+		// Use alignment reported by file system, otherwise assume a page
+		struct statx st;
+		uint32_t image_align = IO_ARENA_ALIGN;
+		if ((statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &st) == 0) && (st.stx_mask & STATX_DIOALIGN) &&
+			(st.stx_dio_offset_align > 0))
+		{
+			image_align = (st.stx_dio_offset_align > st.stx_dio_mem_align) ? st.stx_dio_offset_align : st.stx_dio_mem_align;
+		}
+		*align = (image_align > *align) ? image_align : *align;
+	}
+	else if ((direct == 0) || (errno == EINVAL))
+	{
+		// Fall back to buffered I/O if file system does not support direct I/O
+		fd = open(name, flags);
+	}
+
+	return fd;
+}
+
+
+/**
+* @brief 	Open disk, or striped volume given by volume descriptor
+* @param 	disk_name - name of disk or volume descriptor
+* @param 	overlay - 1 to open disk read-only and keep writes in a delta
+* @param 	direct - 1 to bypass page cache
+* @param 	checksums - 1 to verify blocks against their checksums
+* @return 	NULL if disk cannot be opened, otherwise disk
+*/
+Io_device *io_open(const char *disk_name, uint8_t overlay, uint8_t direct, uint8_t checksums)
+{
+	int flags = overlay ? O_RDONLY : O_RDWR;
+	uint32_t align = 0;
+
+	// A single disk is a volume of one member
+	uint32_t stripe = IO_BLOCK_COUNT;
+	std::vector<std::string> names;
+	int volume = io_read_volume(disk_name, &stripe, names);
+	if (volume < 0)
+	{
+		return NULL;
+	}
+	if (volume == 0)
+	{
+		names.assign(1, disk_name);
+		stripe = IO_BLOCK_COUNT;
+	}
+
+	std::vector<int> members;
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		int fd = io_open_image(names[i].c_str(), flags, direct, &align);
+		if (fd < 0)
+		{
+			for (size_t j = 0; j < members.size(); j++)
+			{
+				close(members[j]);
+			}
+			return NULL;
+		}
+		members.push_back(fd);
+	}
+
+	Io_device *dev = new Io_device;
+	dev->fd = members[0];
+	dev->members = members;
+	dev->stripe = stripe;
+	strncpy(dev->name, disk_name, sizeof(dev->name) - 1);
+	dev->name[sizeof(dev->name) - 1] = 0;
+	dev->overlay = overlay;
+	dev->align = align;
+	dev->checksums = checksums;
+	memset(dev->sum_known, 0, sizeof(dev->sum_known));
+
+	return dev;
+}
+
+
+/**
+* @brief 	Close disk and drop its delta
+* @param 	dev - disk
+*/
+void io_close(Io_device *dev)
+{
+	io_stop_members(dev);
+	for (size_t i = 0; i < dev->members.size(); i++)
+	{
+		close(dev->members[i]);
+	}
+	delete dev;
+}
+
+
+/**
+* @brief 	Read bytes from disk, or from delta for blocks modified in overlay
+* @param 	dev - disk
+* @param 	buff - buffer to read into
+* @param 	len - number of bytes
+* @param 	offset - offset on disk
+* @return 	number of bytes read
+*/
+ssize_t io_dev_read(Io_device *dev, void *buff, size_t len, off_t offset)
+{
+	ssize_t read_len = io_pread(dev, buff, len, offset);
+
+	// Delta may be written by other threads running commands
+	std::lock_guard<std::mutex> lock(io_mutex);
+	if (dev->delta.empty())
+	{
+		return read_len;
+	}
+
+	for (off_t i = offset / IO_BLOCK_SIZE; i * IO_BLOCK_SIZE < (off_t) (offset + len); i++)
+	{
+		std::map< uint8_t, std::vector<uint8_t> >::iterator it = dev->delta.find(i);
+		if (it != dev->delta.end())
+		{
+			// Copy part of block that overlaps read
+			off_t start = (i * IO_BLOCK_SIZE > offset) ? i * IO_BLOCK_SIZE : offset;
+			off_t end = ((i + 1) * IO_BLOCK_SIZE < (off_t) (offset + len)) ? (i + 1) * IO_BLOCK_SIZE : offset + len;
+			memcpy((uint8_t *) buff + (start - offset), &it->second[start - (i * IO_BLOCK_SIZE)], end - start);
+			read_len = len;
+		}
+	}
+
+	return read_len;
+}
+
+
+/**
+* @brief 	Get stamp that saved checksums are bound to, taken from the
+* 			superblock on disk and the size and modification time of every
+* 			image, so any write to the disk by another run or tool changes it
+* @param 	dev - disk
+* @return 	stamp of disk
+*/
+uint32_t io_sums_stamp(Io_device *dev)
+{
+	Aligned_buffer buff;
+	uint8_t *block = buff.get(IO_BLOCK_SIZE);
+	memset(block, 0, IO_BLOCK_SIZE);
+	io_transfer(dev, 0, block, IO_BLOCK_SIZE, 0);
+	uint32_t stamp = crc32c(0, block, IO_BLOCK_SIZE);
+
+	for (size_t i = 0; i < dev->members.size(); i++)
+	{
+		struct stat st;
+		if (fstat(dev->members[i], &st) == 0)
+		{
+			int64_t image[3] = {(int64_t) st.st_size, (int64_t) st.st_mtim.tv_sec, (int64_t) st.st_mtim.tv_nsec};
+			stamp = crc32c(stamp, image, sizeof(image));
+		}
+	}
+
+	return stamp;
+}
+
+
+/**
+* @brief 	Load saved delta into overlay
+* @param 	dev - disk opened as overlay
+* @param 	delta_name - name of file delta was saved to
+* @return 	0 on success, otherwise -1
+*/
+int io_load_delta(Io_device *dev, const char *delta_name)
+{
+	FILE *fp = fopen(delta_name, "rb");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	char magic[8];
+	if ((fread(magic, 1, 8, fp) != 8) || (memcmp(magic, IO_DELTA_MAGIC, 8) != 0))
+	{
+		fclose(fp);
+		return -1;
+	}
+
+	// Delta is a list of block numbers each followed by the block
+	uint8_t block_num;
+	std::vector<uint8_t> block(IO_BLOCK_SIZE);
+	while (fread(&block_num, 1, 1, fp) == 1)
+	{
+		if ((block_num >= IO_BLOCK_COUNT) || (fread(&block[0], 1, IO_BLOCK_SIZE, fp) != IO_BLOCK_SIZE))
+		{
+			fclose(fp);
+			return -1;
+		}
+		dev->delta[block_num] = block;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+
+/**
+* @brief 	Attach block layer to disk
+* @param 	dev - disk
+*/
+void io_attach(Io_device *dev)
+{
+	io_dev = dev;
+}
+
+
+/**
+* @brief 	Stop read-ahead and drop cached blocks of attached disk
+*/
+void io_detach(void)
+{
+	if (io_worker.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(io_mutex);
+			io_stop = 1;
+		}
+		io_cond.notify_all();
+		io_worker.join();
+		io_stop = 0;
+	}
+
+	io_queue.clear();
+	io_cache.clear();
+	io_cache_order.clear();
+	memset(io_pending, 0, sizeof(io_pending));
+	io_dev = NULL;
+}
+
+
+/**
+* @brief 	Read bytes from disk
+* @param 	buff - buffer to read into
+* @param 	len - number of bytes
+* @param 	offset - offset on disk
+* @return 	number of bytes read
+*/
+ssize_t io_read(void *buff, size_t len, off_t offset)
+{
+	return io_dev_read(io_dev, buff, len, offset);
+}
+
+
+/**
+* @brief 	Write bytes to disk and drop overwritten blocks from cache
+* @param 	buff - buffer to write from
+* @param 	len - number of bytes
+* @param 	offset - offset on disk
+* @return 	number of bytes written
+*/
+ssize_t io_write(const void *buff, size_t len, off_t offset)
+{
+	ssize_t written = len;
+	if (io_dev->overlay == 0)
+	{
+		written = io_pwrite(io_dev, buff, len, offset);
+	}
+	else
+	{
+		// Write only reaches delta in memory, but is still the command's
+		io_trace(IO_TRACE_DELTA, offset, len, io_command, io_line);
+	}
+
+	std::lock_guard<std::mutex> lock(io_mutex);
+	for (off_t i = offset / IO_BLOCK_SIZE; (i < IO_BLOCK_COUNT) && (i * IO_BLOCK_SIZE < (off_t) (offset + len)); i++)
+	{
+		if (io_dev->overlay)
+		{
+			// Copy block from disk into delta on first write
+			std::vector<uint8_t> &block = io_dev->delta[i];
+			if (block.empty())
+			{
+				block.resize(IO_BLOCK_SIZE, 0);
+				io_pread(io_dev, &block[0], IO_BLOCK_SIZE, i * IO_BLOCK_SIZE);
+			}
+
+			off_t start = (i * IO_BLOCK_SIZE > offset) ? i * IO_BLOCK_SIZE : offset;
+			off_t end = ((i + 1) * IO_BLOCK_SIZE < (off_t) (offset + len)) ? (i + 1) * IO_BLOCK_SIZE : offset + len;
+			memcpy(&block[start - (i * IO_BLOCK_SIZE)], (const uint8_t *) buff + (start - offset), end - start);
+			if (io_dev->checksums)
+			{
+				io_dev->sum[i] = crc32c(0, &block[0], IO_BLOCK_SIZE);
+				io_dev->sum_known[i] = 1;
+			}
+		}
+		else if (io_dev->checksums)
+		{
+			// Block written in part is not read back, so its checksum is
+			// taken the next time it is read
+			io_dev->sum_known[i] = (i * IO_BLOCK_SIZE >= offset) && ((i + 1) * IO_BLOCK_SIZE <= (off_t) (offset + len));
+			if (io_dev->sum_known[i])
+			{
+				io_dev->sum[i] = crc32c(0, (const uint8_t *) buff + (i * IO_BLOCK_SIZE - offset), IO_BLOCK_SIZE);
+			}
+		}
+
+		io_invalidate(i);
+	}
+
+	return written;
+}
+
+
+/**
+* @brief 	Copy bytes of host file to disk, inside the kernel when possible,
+* 			and drop overwritten blocks from cache
+* @param 	host_fd - file descriptor of host file
+* @param 	host_offset - offset in host file
+* @param 	len - number of bytes
+* @param 	offset - offset on disk
+* @return 	number of bytes copied
+*/
+ssize_t io_import(int host_fd, off_t host_offset, size_t len, off_t offset)
+{
+	size_t copied = 0;
+
+	// Overlay, direct I/O and striped volumes need the data in user space
+	if ((io_dev->overlay == 0) && (io_dev->align == 0) && (io_dev->members.size() == 1))
+	{
+		io_trace(IO_TRACE_WRITE, offset, len, io_command, io_line);
+		off_t disk_offset = offset;
+		while (copied < len)
+		{
+			ssize_t n = copy_file_range(host_fd, &host_offset, io_dev->fd, &disk_offset, len - copied, 0);
+			if (n <= 0)
+			{
+				break;
+			}
+			copied += n;
+		}
+
+		std::lock_guard<std::mutex> lock(io_mutex);
+		for (off_t i = offset / IO_BLOCK_SIZE; (i < IO_BLOCK_COUNT) && (i * IO_BLOCK_SIZE < (off_t) (offset + copied)); i++)
+		{
+			// Data never passed through user space, so checksum is taken
+			// the next time block is read
+			io_dev->sum_known[i] = 0;
+			io_invalidate(i);
+		}
+	}
+
+	// Copy rest with large reads and writes if kernel copy is not supported
+	Aligned_buffer buff;
+	while (copied < len)
+	{
+		size_t chunk = (len - copied < IO_COPY_CHUNK) ? len - copied : IO_COPY_CHUNK;
+		ssize_t n = pread(host_fd, buff.get(chunk), chunk, host_offset);
+		if ((n <= 0) || (io_write(buff.get(chunk), n, offset + copied) != n))
+		{
+			break;
+		}
+		host_offset += n;
+		copied += n;
+	}
+
+	return copied;
+}
+
+
+/**
+* @brief 	Copy bytes of disk to host file, inside the kernel when possible
+* @param 	host_fd - file descriptor of host file
+* @param 	host_offset - offset in host file
+* @param 	len - number of bytes
+* @param 	offset - offset on disk
+* @return 	number of bytes copied
+*/
+ssize_t io_export(int host_fd, off_t host_offset, size_t len, off_t offset)
+{
+	size_t copied = 0;
+
+	// Blocks changed in overlay are only in delta
+	uint8_t in_delta = 0;
+	for (off_t i = offset / IO_BLOCK_SIZE; i * IO_BLOCK_SIZE < (off_t) (offset + len); i++)
+	{
+		in_delta |= (io_dev->delta.find(i) != io_dev->delta.end());
+	}
+
+	if ((in_delta == 0) && (io_dev->align == 0) && (io_dev->members.size() == 1))
+	{
+		io_trace(IO_TRACE_READ, offset, len, io_command, io_line);
+		off_t disk_offset = offset;
+		while (copied < len)
+		{
+			ssize_t n = copy_file_range(io_dev->fd, &disk_offset, host_fd, &host_offset, len - copied, 0);
+			if (n <= 0)
+			{
+				break;
+			}
+			copied += n;
+		}
+	}
+
+	// Copy rest with large reads and writes if kernel copy is not supported
+	Aligned_buffer buff;
+	while (copied < len)
+	{
+		size_t chunk = (len - copied < IO_COPY_CHUNK) ? len - copied : IO_COPY_CHUNK;
+		ssize_t n = io_read(buff.get(chunk), chunk, offset + copied);
+		if ((n <= 0) || (pwrite(host_fd, buff.get(chunk), n, host_offset) != n))
+		{
+			break;
+		}
+		host_offset += n;
+		copied += n;
+	}
+
+	return copied;
+}
+
+
+/**
+* @brief 	Read block from cache, or from disk if not cached, and verify it
+* 			against its checksum
+* @param 	block_num - block to read
+* @param 	buff - buffer to read into
+* @return 	0 on success, -1 if block does not match its checksum
+*/
+int io_read_block(uint8_t block_num, uint8_t buff[IO_BLOCK_SIZE])
+{
+	uint8_t cached = 0;
+	{
+		std::unique_lock<std::mutex> lock(io_mutex);
+
+		// Wait for prefetch of block to finish instead of reading it twice
+		io_cond.wait(lock, [block_num] { return io_pending[block_num] == 0; });
+
+		std::map< uint8_t, std::vector<uint8_t> >::iterator it = io_cache.find(block_num);
+		if (it != io_cache.end())
+		{
+			memcpy(buff, &it->second[0], IO_BLOCK_SIZE);
+			cached = 1;
+		}
+	}
+
+	if (cached == 0)
+	{
+		io_read(buff, IO_BLOCK_SIZE, block_num * IO_BLOCK_SIZE);
+	}
+
+	return (io_verify(block_num, buff) < 0) ? -1 : 0;
+}
+
+
+/**
+* @brief 	Write block to disk
+* @param 	block_num - block to write
+* @param 	buff - buffer to write from
+*/
+void io_write_block(uint8_t block_num, const uint8_t buff[IO_BLOCK_SIZE])
+{
+	io_write(buff, IO_BLOCK_SIZE, block_num * IO_BLOCK_SIZE);
+}
+
+
+/**
+* @brief 	Move run of blocks with one read and one write, which reach every
+* 			member of a striped volume at once, and zero the blocks of the
+* 			run that the moved run does not cover
+* @param 	from_block - first block of run
+* @param 	to_block - first block run is moved to
+* @param 	count - number of blocks in run
+* @param 	corrupt - filled with blocks of run that did not match their checksum
+* @return 	0 on success, -1 if a block did not match its checksum
+*/
+int io_move_blocks(uint8_t from_block, uint8_t to_block, uint8_t count, std::vector<uint8_t> &corrupt)
+{
+	Aligned_buffer run_buff;
+	uint8_t *buff = run_buff.get(count * IO_BLOCK_SIZE);
+	io_read(buff, count * IO_BLOCK_SIZE, from_block * IO_BLOCK_SIZE);
+
+	// Checksums of corrupt blocks, taken before the write replaces them
+	std::vector<uint32_t> bad_sums;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		if (io_verify(from_block + i, buff + (i * IO_BLOCK_SIZE)) < 0)
+		{
+			corrupt.push_back(from_block + i);
+			bad_sums.push_back(io_dev->sum[from_block + i]);
+		}
+	}
+
+	io_write(buff, count * IO_BLOCK_SIZE, to_block * IO_BLOCK_SIZE);
+
+	if (!corrupt.empty())
+	{
+		// Moved block keeps the checksum it failed, so it is still reported
+		// as corrupt instead of getting a checksum of the corrupt data
+		std::lock_guard<std::mutex> lock(io_mutex);
+		for (size_t i = 0; i < corrupt.size(); i++)
+		{
+			uint8_t block_num = to_block + (corrupt[i] - from_block);
+			io_dev->sum[block_num] = bad_sums[i];
+			io_dev->sum_known[block_num] = 1;
+		}
+	}
+
+	// Part of old run that overlaps new run already holds moved data
+	int clear_start = from_block;
+	int clear_end = from_block + count;
+	if (to_block <= from_block)
+	{
+		clear_start = (to_block + count > from_block) ? to_block + count : from_block;
+	}
+	else
+	{
+		clear_end = (to_block < from_block + count) ? to_block : from_block + count;
+	}
+
+	if (clear_end > clear_start)
+	{
+		memset(buff, 0, (clear_end - clear_start) * IO_BLOCK_SIZE);
+		io_write(buff, (clear_end - clear_start) * IO_BLOCK_SIZE, clear_start * IO_BLOCK_SIZE);
+	}
+
+	return corrupt.empty() ? 0 : -1;
+}
+
+
+/**
+* @brief 	Read contiguous blocks into cache in the background
+* @param 	start_block - first block to read
+* @param 	count - number of blocks
+*/
+void io_prefetch(uint8_t start_block, uint8_t count)
+{
+	Prefetch request;
+	request.start_block = start_block;
+	request.count = 0;
+	memcpy(request.command, io_command, 7);
+	request.line = io_line;
+
+	std::lock_guard<std::mutex> lock(io_mutex);
+
+	// Skip blocks already cached or requested
+	for (uint8_t i = 0; i < count; i++)
+	{
+		uint8_t block_num = start_block + i;
+		if (io_pending[block_num] || (io_cache.find(block_num) != io_cache.end()))
+		{
+			if (request.count > 0)
+			{
+				break;
+			}
+			request.start_block = block_num + 1;
+			continue;
+		}
+
+		io_pending[block_num] = 1;
+		request.generation[block_num] = io_generation[block_num];
+		request.count++;
+	}
+
+	if (request.count == 0)
+	{
+		return;
+	}
+
+	if (!io_worker.joinable())
+	{
+		io_worker = std::thread(io_prefetch_worker);
+	}
+
+	io_queue.push_back(request);
+	io_cond.notify_all();
+}
+
+
+/**
+* @brief 	Verify share of blocks against their checksums, reading
+* 			consecutive blocks together
+* @param 	blocks - blocks to verify, in increasing order
+* @param 	start - index of first block of share
+* @param 	end - index after last block of share
+* @param 	result - outcome of share
+* @param 	command - command that started scrub
+* @param 	line - line of command in input file
+*/
+void io_scrub_worker(const std::vector<uint8_t> *blocks, size_t start, size_t end, Io_scrub *result,
+	const char *command, uint32_t line)
+{
+	// Reads are recorded for the command that started scrub
+	io_set_command(command, line);
+
+	Aligned_buffer run_buff;
+	uint8_t *buff = run_buff.get(IO_SCRUB_RUN * IO_BLOCK_SIZE);
+
+	size_t i = start;
+	while (i < end)
+	{
+		size_t count = 1;
+		while ((i + count < end) && (count < IO_SCRUB_RUN) && ((*blocks)[i + count] == (*blocks)[i] + count))
+		{
+			count++;
+		}
+
+		off_t offset = (*blocks)[i] * IO_BLOCK_SIZE;
+		io_trace(IO_TRACE_READ, offset, count * IO_BLOCK_SIZE, io_command, io_line);
+		ssize_t len = io_transfer(io_dev, 0, buff, count * IO_BLOCK_SIZE, offset);
+
+		for (size_t j = 0; j < count; j++)
+		{
+			uint8_t block_num = (*blocks)[i + j];
+			const uint8_t *data = buff + (j * IO_BLOCK_SIZE);
+
+			// Blocks modified in overlay are taken from delta instead of disk
+			std::map< uint8_t, std::vector<uint8_t> >::const_iterator it = io_dev->delta.find(block_num);
+			if (it != io_dev->delta.end())
+			{
+				data = &it->second[0];
+			}
+			else if (len < (ssize_t) ((j + 1) * IO_BLOCK_SIZE))
+			{
+				result->corrupt.push_back(block_num);
+				continue;
+			}
+
+			int status = io_verify(block_num, data);
+			if (status < 0)
+			{
+				result->corrupt.push_back(block_num);
+			}
+			else if (status > 0)
+			{
+				result->recorded++;
+			}
+			else
+			{
+				result->verified++;
+			}
+		}
+
+		i += count;
+	}
+}
+
+
+/**
+* @brief 	Verify blocks of attached disk against their checksums, splitting
+* 			blocks between threads
+* @param 	blocks - blocks to verify, in increasing order
+* @param 	threads - number of threads
+* @param 	result - outcome of every block
+*/
+void io_scrub(const std::vector<uint8_t> &blocks, int threads, Io_scrub *result)
+{
+	if (threads > (int) blocks.size())
+	{
+		threads = blocks.size();
+	}
+	if (threads < 1)
+	{
+		threads = 1;
+	}
+
+	// Each thread verifies a contiguous share of blocks, and only sets the
+	// checksums of its own blocks
+	std::vector<Io_scrub> results(threads);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+	{
+		results[t].verified = 0;
+		results[t].recorded = 0;
+		workers.push_back(std::thread(io_scrub_worker, &blocks, blocks.size() * t / threads,
+			blocks.size() * (t + 1) / threads, &results[t], io_command, io_line));
+	}
+
+	result->verified = 0;
+	result->recorded = 0;
+	result->corrupt.clear();
+	for (int t = 0; t < threads; t++)
+	{
+		workers[t].join();
+		result->verified += results[t].verified;
+		result->recorded += results[t].recorded;
+		result->corrupt.insert(result->corrupt.end(), results[t].corrupt.begin(), results[t].corrupt.end());
+	}
+}
+
+
+/**
+* @brief 	Load saved block checksums of disk
+* @param 	dev - disk
+* @param 	sum_name - name of file checksums were saved to
+* @return 	0 on success, otherwise -1
+*/
+int io_load_sums(Io_device *dev, const char *sum_name)
+{
+	FILE *fp = fopen(sum_name, "rb");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	// Checksums only hold for the disk as it was when they were saved
+	char magic[8];
+	uint32_t stamp;
+	uint8_t valid = (fread(magic, 1, 8, fp) == 8) && (memcmp(magic, IO_SUMS_MAGIC, 8) == 0) &&
+		(fread(&stamp, sizeof(uint32_t), 1, fp) == 1) && (stamp == io_sums_stamp(dev)) &&
+		(fread(dev->sum_known, 1, IO_BLOCK_COUNT, fp) == IO_BLOCK_COUNT) &&
+		(fread(dev->sum, sizeof(uint32_t), IO_BLOCK_COUNT, fp) == IO_BLOCK_COUNT);
+	fclose(fp);
+
+	if (valid == 0)
+	{
+		memset(dev->sum_known, 0, sizeof(dev->sum_known));
+		return -1;
+	}
+
+	// Blocks of a loaded delta differ from the disk
+	for (std::map< uint8_t, std::vector<uint8_t> >::iterator it = dev->delta.begin(); it != dev->delta.end(); it++)
+	{
+		dev->sum_known[it->first] = 0;
+	}
+
+	return 0;
+}
+
+
+/**
+* @brief 	Save delta of attached overlay to file
+* @param 	delta_name - name of file to save delta to
+* @return 	0 on success, otherwise -1
+*/
+int io_save_delta(const char *delta_name)
+{
+	FILE *fp = fopen(delta_name, "wb");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	fwrite(IO_DELTA_MAGIC, 1, 8, fp);
+	for (std::map< uint8_t, std::vector<uint8_t> >::iterator it = io_dev->delta.begin(); it != io_dev->delta.end(); it++)
+	{
+		fwrite(&it->first, 1, 1, fp);
+		fwrite(&it->second[0], 1, IO_BLOCK_SIZE, fp);
+	}
+
+	return fclose(fp);
+}
+
+
+/**
+* @brief 	Write delta of attached overlay to disk and clear delta
+* @return 	0 on success, otherwise -1
+*/
+int io_commit(void)
+{
+	// Overlay keeps disk open read-only, so open it again for writing
+	Io_device *writer = io_open(io_dev->name, 0, 0, 0);
+	if (writer == NULL)
+	{
+		return -1;
+	}
+
+	for (std::map< uint8_t, std::vector<uint8_t> >::iterator it = io_dev->delta.begin(); it != io_dev->delta.end(); it++)
+	{
+		// Checksum of block is taken again from the disk on its next read
+		io_dev->sum_known[it->first] = 0;
+		if (io_pwrite(writer, &it->second[0], IO_BLOCK_SIZE, it->first * IO_BLOCK_SIZE) != IO_BLOCK_SIZE)
+		{
+			io_close(writer);
+			return -1;
+		}
+	}
+	io_close(writer);
+
+	// Cached blocks already match delta, so they stay valid
+	std::lock_guard<std::mutex> lock(io_mutex);
+	io_dev->delta.clear();
+
+	return 0;
+}
+
+
+/**
+* @brief 	Save block checksums of attached disk to file
+* @param 	sum_name - name of file to save checksums to
+* @return 	0 on success, otherwise -1
+*/
+int io_save_sums(const char *sum_name)
+{
+	FILE *fp = fopen(sum_name, "wb");
+	if (fp == NULL)
+	{
+		return -1;
+	}
+
+	uint32_t stamp = io_sums_stamp(io_dev);
+	fwrite(IO_SUMS_MAGIC, 1, 8, fp);
+	fwrite(&stamp, sizeof(uint32_t), 1, fp);
+	fwrite(io_dev->sum_known, 1, IO_BLOCK_COUNT, fp);
+	fwrite(io_dev->sum, sizeof(uint32_t), IO_BLOCK_COUNT, fp);
+
+	return fclose(fp);
+}
+
+
+/**
+* @brief 	Start recording every disk access to a trace file
+* @param 	trace_name - name of trace file
+* @return 	0 on success, otherwise -1
+*/
+int io_trace_open(const char *trace_name)
+{
+	io_trace_fp = fopen(trace_name, "wb");
+	if (io_trace_fp == NULL)
+	{
+		return -1;
+	}
+
+	fwrite(IO_TRACE_MAGIC, 1, 8, io_trace_fp);
+	return 0;
+}
+
+
+/**
+* @brief 	Stop recording disk accesses
+*/
+void io_trace_close(void)
+{
+	std::lock_guard<std::mutex> lock(io_trace_mutex);
+	if (io_trace_fp != NULL)
+	{
+		fclose(io_trace_fp);
+		io_trace_fp = NULL;
+	}
+}
+
+
+/**
+* @brief 	Set command that following disk accesses of calling thread are
+* 			recorded for
+* @param 	command - command name
+* @param 	line - line of command in input file
+*/
+void io_set_command(const char *command, uint32_t line)
+{
+	strncpy(io_command, command, 7);
+	io_line = line;
+}
+
+
+/**
+* @brief 	Record in I/O trace that a command was run, so commands without
+* 			disk accesses are counted
+* @param 	command - command name
+* @param 	line - line of command in input file
+*/
+void io_trace_command(const char *command, uint32_t line)
+{
+	char name[7];
+	strncpy(name, command, 7);
+	io_trace(IO_TRACE_COMMAND, 0, 0, name, line);
+}
+
+
+/**
+* @brief 	Get block buffer from arena, aligned for direct I/O
+* @return 	block buffer, returned with io_free_block()
+*/
+uint8_t *io_alloc_block(void)
+{
+	if (io_arena.empty())
+	{
+		uint8_t *buff;
+		if (posix_memalign((void **) &buff, IO_ARENA_ALIGN, IO_ARENA_ALIGN) != 0)
+		{
+			abort();
+		}
+		return buff;
+	}
+
+	uint8_t *buff = io_arena.back();
+	io_arena.pop_back();
+	return buff;
+}
+
+
+/**
+* @brief 	Return block buffer to arena
+* @param 	buff - buffer from io_alloc_block()
+*/
+void io_free_block(uint8_t *buff)
+{
+	io_arena.push_back(buff);
+}
+
+
+/**
+* @brief 	Get block of zeros from arena, aligned for direct I/O
+* @return 	block of zeros that must not be written to
+*/
+const uint8_t *io_zero_block(void)
+{
+	if (io_arena_zero == NULL)
+	{
+		io_arena_zero = io_alloc_block();
+		memset(io_arena_zero, 0, IO_ARENA_ALIGN);
+	}
+
+	return io_arena_zero;
+}
@@ -0,0 +1,125 @@
+#ifndef BLOCKIO_H
+#define BLOCKIO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "Geometry.h"
+
+// Disk geometry
+#define IO_BLOCK_SIZE           Fs_geometry::BLOCK_SIZE
+#define IO_BLOCK_COUNT          Fs_geometry::BLOCK_COUNT
+
+// Max number of blocks held by the read-ahead cache
+#define IO_CACHE_BLOCKS         32
+
+// Max bytes moved by one read and write when copying host files
+#define IO_COPY_CHUNK           (1 << 20)
+
+// Max scrub threads, and max blocks read by one scrub read
+#define IO_SCRUB_THREADS        8
+#define IO_SCRUB_RUN            64
+
+// Max members of a striped volume, and blocks per stripe unit when the
+// volume descriptor does not give it
+#define IO_MAX_MEMBERS          16
+#define IO_STRIPE_BLOCKS        8
+
+// Magic line at start of striped volume descriptor
+#define IO_VOLUME_MAGIC         "FSVOLUME"
+
+// Alignment of buffers handed out by the block buffer arena
+#define IO_ARENA_ALIGN          4096
+
+// Operations recorded in I/O trace
+#define IO_TRACE_READ           0
+#define IO_TRACE_WRITE          1
+#define IO_TRACE_SEEK           2
+#define IO_TRACE_DELTA          3
+#define IO_TRACE_COMMAND        4
+
+// Magic number at start of I/O trace
+#define IO_TRACE_MAGIC          "FSIOTRC1"
+
+// Disk access recorded in I/O trace
+typedef struct __attribute__((packed)) {
+	uint8_t op;          // IO_TRACE_READ, IO_TRACE_WRITE, IO_TRACE_SEEK, IO_TRACE_DELTA or IO_TRACE_COMMAND
+	char command[7];     // Command that caused the access, not null terminated if 7 characters
+	uint32_t line;       // Line of command in input file
+	uint32_t offset;     // Offset on disk, or offset seeked to, 0 for a command
+	uint32_t length;     // Bytes accessed, or seek distance in bytes, 0 for a command
+} Io_record;
+
+// Disk that file system blocks are read from and written to
+typedef struct {
+	int fd;              // Disk, or first member of a striped volume, opened read-only for an overlay
+	std::vector<int> members;  // Image of each member of a striped volume, only fd for a single disk
+	uint32_t stripe;     // Blocks per stripe unit of a striped volume
+	char name[50];       // Name of disk, or of volume descriptor
+	uint8_t overlay;     // Writes go to delta instead of disk
+	uint32_t align;      // Alignment required by direct I/O, 0 for buffered I/O
+	std::map< uint8_t, std::vector<uint8_t> > delta;  // Blocks modified in overlay
+	uint8_t checksums;   // Blocks are verified against their checksums
+	uint8_t sum_known[IO_BLOCK_COUNT];  // Checksum of block has been taken
+	uint32_t sum[IO_BLOCK_COUNT];       // CRC32C of each block
+} Io_device;
+
+// Outcome of verifying blocks against their checksums
+typedef struct {
+	uint32_t verified;             // Blocks that matched their checksum
+	uint32_t recorded;             // Blocks without a checksum, whose checksum was taken
+	std::vector<uint8_t> corrupt;  // Blocks that did not match their checksum
+} Io_scrub;
+
+/**
+* @brief 	Map offset in striped volume to member that holds it
+* @param 	offset - offset in volume
+* @param 	stripe - blocks per stripe unit
+* @param 	count - number of members
+* @param 	member - member that holds offset
+* @return 	offset in member
+*/
+static inline off_t io_stripe_map(off_t offset, uint32_t stripe, size_t count, size_t *member)
+{
+	// Stripe units are dealt to members in turn
+	off_t unit_bytes = (off_t) stripe * IO_BLOCK_SIZE;
+	off_t unit = offset / unit_bytes;
+	*member = unit % count;
+	return ((unit / count) * unit_bytes) + (offset % unit_bytes);
+}
+
+int io_read_volume(const char *name, uint32_t *stripe, std::vector<std::string> &members);
+Io_device *io_open(const char *disk_name, uint8_t overlay, uint8_t direct, uint8_t checksums);
+void io_close(Io_device *dev);
+ssize_t io_dev_read(Io_device *dev, void *buff, size_t len, off_t offset);
+int io_load_delta(Io_device *dev, const char *delta_name);
+int io_load_sums(Io_device *dev, const char *sum_name);
+
+void io_attach(Io_device *dev);
+void io_detach(void);
+ssize_t io_read(void *buff, size_t len, off_t offset);
+ssize_t io_write(const void *buff, size_t len, off_t offset);
+ssize_t io_import(int host_fd, off_t host_offset, size_t len, off_t offset);
+ssize_t io_export(int host_fd, off_t host_offset, size_t len, off_t offset);
+int io_read_block(uint8_t block_num, uint8_t buff[IO_BLOCK_SIZE]);
+void io_write_block(uint8_t block_num, const uint8_t buff[IO_BLOCK_SIZE]);
+int io_move_blocks(uint8_t from_block, uint8_t to_block, uint8_t count, std::vector<uint8_t> &corrupt);
+void io_prefetch(uint8_t start_block, uint8_t count);
+void io_scrub(const std::vector<uint8_t> &blocks, int threads, Io_scrub *result);
+
+uint8_t *io_alloc_block(void);
+void io_free_block(uint8_t *buff);
+const uint8_t *io_zero_block(void);
+
+int io_trace_open(const char *trace_name);
+void io_trace_close(void);
+void io_set_command(const char *command, uint32_t line);
+void io_trace_command(const char *command, uint32_t line);
+
+int io_save_delta(const char *delta_name);
+int io_commit(void);
+int io_save_sums(const char *sum_name);
+
+#endif
@@ -0,0 +1,135 @@
+#include "Checksum.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Reflected CRC32C (Castagnoli) polynomial
+#define CRC32C_POLY             0x82F63B78
+
+// Remainder of every byte value followed by 0 to 7 zero bytes, so 8 bytes
+// are added with 8 independent lookups instead of a chain of 8
+uint32_t crc32c_table[8][256];
+
+
+/**
+* @brief 	Build tables of remainders
+* @return 	1
+*/
+uint8_t crc32c_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (uint8_t j = 0; j < 8; j++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		for (uint8_t j = 1; j < 8; j++)
+		{
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xFF] ^ (crc32c_table[j - 1][i] >> 8);
+		}
+	}
+	return 1;
+}
+
+
+/**
+* @brief 	Extend inverted CRC32C checksum 8 bytes at a time with tables
+* @param 	crc - inverted checksum of preceding bytes
+* @param 	bytes - bytes to add
+* @param 	len - number of bytes
+* @return 	inverted checksum
+*/
+uint32_t crc32c_portable(uint32_t crc, const uint8_t *bytes, size_t len)
+{
+	// Built once, also when scrub threads start together
+	static const uint8_t ready = crc32c_init();
+	(void) ready;
+
+	for (; len >= 8; len -= 8, bytes += 8)
+	{
+		uint32_t low = crc ^ ((uint32_t) bytes[0] | ((uint32_t) bytes[1] << 8) |
+			((uint32_t) bytes[2] << 16) | ((uint32_t) bytes[3] << 24));
+		crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+			crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+			crc32c_table[3][bytes[4]] ^ crc32c_table[2][bytes[5]] ^
+			crc32c_table[1][bytes[6]] ^ crc32c_table[0][bytes[7]];
+	}
+
+	for (; len > 0; len--, bytes++)
+	{
+		crc = crc32c_table[0][(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+
+#if defined(__x86_64__)
+/**
+* @brief 	Extend inverted CRC32C checksum 8 bytes at a time with SSE4.2
+* @param 	crc - inverted checksum of preceding bytes
+* @param 	bytes - bytes to add
+* @param 	len - number of bytes
+* @return 	inverted checksum
+*/
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *bytes, size_t len)
+{
+	uint64_t crc64 = crc;
+	for (; len >= 8; len -= 8, bytes += 8)
+	{
+		uint64_t word;
+		memcpy(&word, bytes, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+
+	crc = crc64;
+	for (; len > 0; len--, bytes++)
+	{
+		crc = _mm_crc32_u8(crc, *bytes);
+	}
+
+	return crc;
+}
+#endif
+
+
+/**
+* @brief 	Check if CRC32C instructions are used
+* @return 	1 if SSE4.2 is used, 0 if portable code is used
+*/
+uint8_t crc32c_hardware(void)
+{
+#if defined(__x86_64__)
+	static const uint8_t supported = (__builtin_cpu_supports("sse4.2") != 0);
+	return supported;
+#else
+	return 0;
+#endif
+}
+
+
+/**
+* @brief 	Extend CRC32C checksum with bytes
+* @param 	crc - checksum of preceding bytes, 0 for first bytes
+* @param 	buff - bytes to add
+* @param 	len - number of bytes
+* @return 	checksum
+*/
+uint32_t crc32c(uint32_t crc, const void *buff, size_t len)
+{
+#if defined(__x86_64__)
+	if (crc32c_hardware())
+	{
+		return ~crc32c_sse42(~crc, (const uint8_t *) buff, len);
+	}
+#endif
+
+	return ~crc32c_portable(~crc, (const uint8_t *) buff, len);
+}
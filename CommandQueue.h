@@ -0,0 +1,111 @@
+#ifndef COMMANDQUEUE_H
+#define COMMANDQUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Times a side checks the queue again before it sleeps until the other side
+// pushes or pops
+#define QUEUE_SPINS             64
+
+// Bounded lock-free queue for one producer thread and one consumer thread.
+// Slots are filled and drained in place, so the producer writes into the
+// slot returned by write_slot() and publishes it with push(), and the
+// consumer reads the slot returned by read_slot() and releases it with pop().
+// A side that finds the queue full or empty spins briefly and then sleeps,
+// so a stalled parser or executor does not keep the other one on the CPU.
+template <typename T, size_t N>
+class Command_queue
+{
+public:
+	Command_queue() : head(0), tail(0), sleepers(0) {}
+
+	/**
+	* @brief 	Get free slot to fill, waiting while queue is full
+	* @return 	slot to fill
+	*/
+	T *write_slot(void)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		wait([this, t] { return t - head.load(std::memory_order_seq_cst) != N; });
+		return &slots[t % N];
+	}
+
+	/**
+	* @brief 	Publish slot returned by write_slot() to consumer
+	*/
+	void push(void)
+	{
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+		wake();
+	}
+
+	/**
+	* @brief 	Get oldest published slot, waiting while queue is empty
+	* @return 	slot to read
+	*/
+	T *read_slot(void)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		wait([this, h] { return tail.load(std::memory_order_seq_cst) != h; });
+		return &slots[h % N];
+	}
+
+	/**
+	* @brief 	Release slot returned by read_slot() to producer
+	*/
+	void pop(void)
+	{
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+		wake();
+	}
+
+private:
+	/**
+	* @brief 	Wait until condition holds, spinning before sleeping
+	* @param 	ready - condition on head or tail
+	*/
+	template <typename F>
+	void wait(F ready)
+	{
+		for (int i = 0; i < QUEUE_SPINS; i++)
+		{
+			if (ready())
+			{
+				return;
+			}
+			std::this_thread::yield();
+		}
+
+		// Sleeper is counted before the condition is checked again, so the
+		// other side either sees it or its update is seen here
+		std::unique_lock<std::mutex> lock(mutex);
+		sleepers.fetch_add(1, std::memory_order_seq_cst);
+		cond.wait(lock, ready);
+		sleepers.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	/**
+	* @brief 	Wake a side sleeping in wait() after head or tail moved
+	*/
+	void wake(void)
+	{
+		if (sleepers.load(std::memory_order_seq_cst) > 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			cond.notify_all();
+		}
+	}
+
+	T slots[N];
+	alignas(64) std::atomic<size_t> head;  // Next slot to read, only written by consumer
+	alignas(64) std::atomic<size_t> tail;  // Next slot to fill, only written by producer
+	alignas(64) std::atomic<int> sleepers; // Sides sleeping in wait()
+	std::mutex mutex;
+	std::condition_variable cond;
+};
+
+#endif
@@ -1,4 +1,9 @@
 #include "FileSystem.h"
+#include "BlockIO.h"
+#include "CommandQueue.h"
+#include "Checksum.h"
+#include "Snapshot.h"
+#include "Perf.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -9,29 +14,310 @@
 #include <map>
 #include <vector>
 #include <queue>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
 
 // Max command size
 #define CMD_MAX_SIZE            2048
 
+// Max number of tokens in a command
+#define CMD_MAX_ARGS            6
+
+// Number of decoded commands queued between parser and executor
+#define COMMAND_QUEUE_SIZE      64
+
+// Max reader threads, and max reads handed to them at once
+#define MAX_READERS             16
+#define READER_PINS             64
+
+// Max worker threads running reads and writes, and max commands handed to
+// them before they are waited for
+#define MAX_WORKERS             16
+#define DATA_WINDOW             64
+
+// Read-ahead window limits in blocks
+#define READ_AHEAD_MIN          2
+#define READ_AHEAD_MAX          16
+
+// Magic number at start of clean unmount record
+#define META_MAGIC              "FSMETA01"
+
+// Number of file handles
+#define MAX_HANDLES             16
+
 // Check bit macro
 #define CHECK_BIT(var, pos)		((var) & (1 << (pos)))
 
+// Disk geometry
+#define FS_BLOCK_SIZE           Fs_geometry::BLOCK_SIZE
+#define FS_BLOCK_COUNT          ((int) Fs_geometry::BLOCK_COUNT)
+#define FS_INODE_COUNT          Fs_geometry::INODE_COUNT
+#define FS_NAME_LEN             Fs_geometry::NAME_LEN
+#define FS_ROOT                 Fs_geometry::ROOT
+#define FS_MAX_FILE_BLOCKS      ((int) Fs_geometry::MAX_FILE_BLOCKS)
+#define FS_MAP_ENTRIES          Fs_geometry::MAP_ENTRIES
+#define FS_FREE_LIST_SIZE       Fs_geometry::FREE_LIST_SIZE
+
+// Parent of detached directories waiting to be reclaimed, one past the last
+// inode so it is never a real directory
+#define FS_ORPHAN               Fs_geometry::INODE_COUNT
+
+// Max inodes reclaimed from detached directories after each command, or -1
+// to reclaim every one
+#define RECLAIM_BATCH           8
+#define RECLAIM_ALL             -1
+
+// Used bit of used_size and directory bit of dir_parent
+#define CHECK_FLAG(var)         ((var) & Fs_geometry::FLAG)
+#define FS_FLAG                 Fs_geometry::FLAG
+#define FS_MASK                 Fs_geometry::MASK
+
 // File system parameters
 int fs_fd = -1;
+Io_device *fs_dev = NULL;
 Super_block fs_sb;
 char disk_name[50] = "";
 
+// Saved overlay delta the disk was mounted with, empty if none
+std::string delta_path;
+
 uint8_t curr_dir = 0;
 std::map< uint8_t, std::set<uint8_t> > dir_map;
 
-uint8_t data_buffer[1024];
+std::map< uint8_t, Block_map > file_maps;
+
+// Number of block map entries pointing to each data block that more than one
+// entry points to after dedup, rebuilt from block maps at mount. Up to 126
+// block maps of 127 entries can point to one block, more than 8 bits can count
+std::map< uint8_t, uint16_t > block_refs;
+
+// Inodes of every file and directory by name, ordered for prefix queries
+std::map< std::string, std::set<uint8_t> > name_index;
+
+// Totals of directory subtree, excluding the directory itself
+typedef struct {
+	int blocks;  // Blocks used by files, including block maps
+	int files;
+	int dirs;
+} Dir_usage;
+
+std::map< uint8_t, Dir_usage > dir_usage;
+
+// Goal block of each directory, where runs for its files are searched from,
+// set after the last block allocated to it
+std::map< uint8_t, int > dir_goal;
+
+// Each worker thread has its own buffer, so reads and writes handed to it
+// do not share the buffer of the executor
+alignas(IO_ARENA_ALIGN) thread_local uint8_t data_buffer[FS_BLOCK_SIZE];
+
+// Streams the thread prints output and errors to. A command run while earlier
+// reads may still print has its streams pointed at memory, without changing
+// stdout and stderr for other threads.
+thread_local FILE *fs_out = stdout;
+thread_local FILE *fs_err = stderr;
+
+// Create files without reserving their data blocks
+uint8_t sparse_mode = 0;
+
+// Mount disks read-only and keep changes in an overlay delta
+uint8_t overlay_mode = 0;
+
+// Open disks with O_DIRECT, bypassing the page cache
+uint8_t direct_mode = 0;
+
+// Skip consistency checks of disks that were cleanly unmounted
+uint8_t clean_mode = 0;
+
+// Verify blocks against checksums saved next to disk as <disk>.sum
+uint8_t checksum_mode = 0;
+
+// Place files of a directory near each other
+uint8_t locality_mode = 0;
+
+// Count cycles, instructions, cache and branch misses of every command
+uint8_t perf_mode = 0;
+
+// Detach deleted directories at once and reclaim them between commands
+uint8_t orphan_mode = 0;
+
+// Merge identical data blocks before fs_defrag packs the disk
+uint8_t dedup_mode = 0;
+
+// Counters of commands of one type
+typedef struct {
+	int count;
+	uint64_t value[PERF_COUNTERS];
+} Perf_total;
+
+std::map< std::string, Perf_total > perf_totals;
+
+// Header of clean unmount record, saved next to disk as <disk>.meta
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint8_t clean;        // 1 if disk was unmounted cleanly, 0 while mounted
+	uint32_t crc;         // CRC32C of superblock, block maps and directory index
+	uint32_t index_size;  // Bytes of directory index following header
+} Meta_header;
+
+// Sequential read state of a file
+typedef struct {
+	uint8_t next_block;   // File block read next by a sequential reader
+	uint8_t window;       // Read-ahead window, 0 if reads are not sequential
+	uint8_t ahead_block;  // First file block not yet prefetched
+} Read_stream;
+
+std::map< uint8_t, Read_stream > read_streams;
+std::mutex read_stream_mutex;
+
+// Open file bound to a resolved inode
+typedef struct {
+	uint8_t open;
+	uint8_t inode_index;
+	uint8_t mapped;       // File is a mapped file
+	uint8_t start_block;  // Cached start block of file
+	uint8_t size;         // Cached logical size of file
+} File_handle;
+
+File_handle handles[MAX_HANDLES];
+
+// Types of decoded commands
+enum Command_type {
+	CMD_INVALID,
+	CMD_END,
+	CMD_MOUNT,
+	CMD_CREATE,
+	CMD_DELETE,
+	CMD_READ,
+	CMD_WRITE,
+	CMD_BUFF,
+	CMD_LS,
+	CMD_RESIZE,
+	CMD_DEFRAG,
+	CMD_CD,
+	CMD_OVERLAY,
+	CMD_MOVE,
+	CMD_DU,
+	CMD_TREE,
+	CMD_OPEN,
+	CMD_CLOSE,
+	CMD_HREAD,
+	CMD_HWRITE,
+	CMD_HRESIZE,
+	CMD_FIND,
+	CMD_IMPORT,
+	CMD_EXPORT,
+	CMD_SCRUB,
+	CMD_DEDUP,
+	CMD_LOCALITY
+};
+
+// Command decoded from one line of input file
+typedef struct {
+	Command_type type;
+	int line_num;             // Line number used in error messages
+	int num;                  // Size or block number argument
+	int handle;               // Handle argument
+	off_t offset;             // Host file offset argument
+	size_t length;            // Byte count argument
+	char *args[CMD_MAX_ARGS]; // Command arguments pointing into str
+	char str[CMD_MAX_SIZE];   // Line holding command arguments
+} Command;
+
+Command_queue<Command, COMMAND_QUEUE_SIZE> command_queue;
+
+// Version of metadata read by L and find on reader threads
+typedef struct {
+	Super_block sb;
+	std::map< uint8_t, std::set<uint8_t> > dir_map;
+	std::map< uint8_t, Block_map > file_maps;
+	std::map< std::string, std::set<uint8_t> > name_index;
+} Fs_snapshot;
+
+Snapshot_domain<Fs_snapshot, READER_PINS> snapshots;
+
+// Metadata may have changed since the last version was published
+uint8_t snapshot_stale = 1;
+
+// Output of a command that is printed once every earlier output is printed
+typedef struct {
+	Command_type type;         // CMD_LS or CMD_FIND if read is handed to a reader thread
+	uint8_t dir;               // Current directory when read was handed off
+	char pattern[FS_NAME_LEN + 2];  // Pattern of find
+	const Fs_snapshot *snap;   // Pinned metadata version, NULL if no file system is mounted
+	size_t pin;
+	std::string out;
+	std::string err;
+	std::atomic<uint8_t> done;
+} Command_output;
+
+// Reader threads running L and find, 0 to run them on the executor thread
+int reader_count = 0;
+std::vector<std::thread> readers;
+std::mutex reader_mutex;
+std::condition_variable reader_cond;
+std::deque<Command_output *> reader_queue;
+uint8_t reader_stop = 0;
+
+// Outputs not yet printed, in command order. Reader threads signal a
+// finished output under reader_mutex.
+std::deque<Command_output *> output_queue;
+std::condition_variable output_cond;
+
+// Read or write of one file block handed to a worker thread
+typedef struct Data_task {
+	Command_type type;        // CMD_READ or CMD_WRITE
+	char command[7];          // Command recorded in I/O trace
+	int line_num;
+	uint8_t inode_index;
+	uint8_t block_num;
+	uint8_t data_block;       // Data block holding file block, 0 if never written
+	std::shared_ptr< std::vector<uint8_t> > buff;  // Buffer written, or read into
+	int waiting;              // Earlier conflicting tasks not yet finished
+	std::vector<struct Data_task *> dependents;
+	uint8_t done;
+} Data_task;
+
+// Worker threads running reads and writes, 0 to run them on the executor
+// thread. Tasks and counts are guarded by data_mutex.
+int worker_count = 0;
+std::vector<std::thread> workers;
+std::mutex data_mutex;
+std::condition_variable data_cond;
+std::deque<Data_task *> data_ready;
+int data_running = 0;
+uint8_t data_stop = 0;
+
+// Tasks handed off since workers were last waited for, only used by executor
+std::vector<Data_task *> data_tasks;
+std::map< uint8_t, Data_task * > inode_tasks;  // Last task of each file
+std::map< uint8_t, Data_task * > block_tasks;  // Last task of each data block
+
+// Contents of buffer as of the last command handed off, NULL if it is the
+// buffer of the executor, and the read filling it if it was not run yet
+std::shared_ptr< std::vector<uint8_t> > data_version;
+Data_task *data_producer = NULL;
+
+// Run of used data blocks owned by one inode
+typedef struct {
+	uint8_t start_block;
+	uint8_t size;
+	uint8_t inode_index;
+	int file_block;      // File block of a mapped data block, -1 for a contiguous file or a block map
+} Block_run;
 
 // Custom comparator for priority_queue
 struct custom_compare
 {
-	bool operator()(const uint8_t a, const uint8_t b)
+	bool operator()(const Block_run &a, const Block_run &b)
 	{
-		return fs_sb.inode[a].start_block > fs_sb.inode[b].start_block;
+		return a.start_block > b.start_block;
 	}
 };
 
@@ -49,6 +335,12 @@ uint8_t fs_tokenize(char *command_str, char **argv)
 	char delim[4] = " \t";
 
 	token = strtok(command_str, &delim[0]);
+	if (token == NULL)
+	{
+		// Command only holds whitespace
+		argv[0] = NULL;
+		return 0;
+	}
 
 	// Do not tokenize at whitespace if command is B
 	if (strcmp(token, "B") == 0)
@@ -56,7 +348,7 @@ uint8_t fs_tokenize(char *command_str, char **argv)
 		delim[0] = 0;
 	}
 
-	for (num = 1; num < 5; num++)
+	for (num = 1; num < CMD_MAX_ARGS + 1; num++)
 	{
 		argv[num - 1] = token;
 
@@ -72,19 +364,19 @@ uint8_t fs_tokenize(char *command_str, char **argv)
 
 
 /**
-* @brief 	Search for name in current directory and return inode index if
-* 			found
+* @brief 	Search for name in directory and return inode index if found
+* @param 	dir - index of directory inode, FS_ROOT for root directory
 * @param 	name - name of file or directory to find
 * @return 	-1 if not found, otherwise inode index
 */
-int fs_search_curr_dir(char name[5])
+int fs_search_dir(uint8_t dir, const char *name)
 {
-	if (!dir_map[curr_dir].empty())
+	if (!dir_map[dir].empty())
 	{
-		for (std::set<uint8_t>::iterator it = dir_map[curr_dir].begin(); it != dir_map[curr_dir].end(); it++)
+		for (std::set<uint8_t>::iterator it = dir_map[dir].begin(); it != dir_map[dir].end(); it++)
 		{
 			Inode *inode = &fs_sb.inode[*it];
-			if (strncmp(name, inode->name, 5) == 0)
+			if (strncmp(name, inode->name, FS_NAME_LEN) == 0)
 			{
 				return (int) *it;
 			}
@@ -96,1127 +388,4367 @@ int fs_search_curr_dir(char name[5])
 
 
 /**
-* @brief 	Set bits to value in free block list of disk superblock
-* @param 	start_block - first block to set to value
-* @param 	end_block - end block to set to value
-* @param 	value - 0 or 1
+* @brief 	Add file or directory to name index
+* @param 	inode_index - index of inode
 */
-void fs_set_free_blocks(uint8_t start_block, uint8_t end_block, uint8_t value)
+void fs_index_add(uint8_t inode_index)
 {
-	for (uint8_t i = start_block; i <= end_block; i++)
-	{
-		uint8_t list_index = i / 8;
-		uint8_t bit_index = 7 - (i % 8);
+	name_index[std::string(fs_sb.inode[inode_index].name, strnlen(fs_sb.inode[inode_index].name, FS_NAME_LEN))].insert(inode_index);
+}
 
-		if (value == 0)
-		{
-			fs_sb.free_block_list[list_index] &= ~(1 << bit_index);
-		}
-		else
+
+/**
+* @brief 	Remove file or directory from name index
+* @param 	inode_index - index of inode
+*/
+void fs_index_remove(uint8_t inode_index)
+{
+	std::string name(fs_sb.inode[inode_index].name, strnlen(fs_sb.inode[inode_index].name, FS_NAME_LEN));
+	std::map< std::string, std::set<uint8_t> >::iterator it = name_index.find(name);
+	if (it != name_index.end())
+	{
+		it->second.erase(inode_index);
+		if (it->second.empty())
 		{
-			fs_sb.free_block_list[list_index] |= (1 << bit_index);
+			name_index.erase(it);
 		}
 	}
 }
 
 
 /**
-* @brief 	Perform consistency checks on file system and mount if valid
-* @param 	new_disk_name - name of disk that contains file system to mount
+* @brief 	Search for name in current directory and return inode index if
+* 			found
+* @param 	name - name of file or directory to find
+* @return 	-1 if not found, otherwise inode index
 */
-void fs_mount(char *new_disk_name)
+int fs_search_curr_dir(char name[5])
 {
-    int fd = open(new_disk_name, O_RDWR);
-    if (fd < 0)
-    {
-		// Unable to open disk
-		fprintf(stderr, "Error: Cannot find disk %s\n", new_disk_name);
-        return;
-    }
+	return fs_search_dir(curr_dir, name);
+}
 
-	// Get superblock from disk
-	Super_block new_fs_sb;
-    read(fd, &new_fs_sb, 1024);
 
-    // Consistency Check 1
-    for (uint8_t i = 0; i < 16; i++)
-    {
-		char fb_byte = new_fs_sb.free_block_list[i];
-        for (uint8_t j = 0; j < 8; j++)
-        {
-            if ((i == 0) && (j == 0))
-            {
-				if (CHECK_BIT(fb_byte, 7 - j) == 0)
-                {
-					// Superblock marked not used in free block list
-					close(fd);
-					fprintf(stderr, "Error: File system in %s is inconsistent (error code: 1)\n", new_disk_name);
-                    return;
-                }
-                continue;
-            }
+/**
+* @brief 	Resolve path of directories separated by '/', relative to current
+* 			directory unless it starts with '/'
+* @param 	path - path to resolve, "." and ".." are allowed
+* @return 	-1 if not found, otherwise inode index, FS_ROOT for root directory
+*/
+int fs_resolve_path(const char *path)
+{
+	int index = (path[0] == '/') ? FS_ROOT : curr_dir;
 
-            uint8_t block_num = (i * 8) + j;
-            uint8_t used = 0;
+	std::string components(path);
+	size_t start = 0;
+	while (start <= components.size())
+	{
+		size_t end = components.find('/', start);
+		if (end == std::string::npos)
+		{
+			end = components.size();
+		}
+		std::string component = components.substr(start, end - start);
+		start = end + 1;
 
-            for (uint8_t k = 0; k < 126; k++)
-            {
-                Inode *inode = &new_fs_sb.inode[k];
-				if (CHECK_BIT(inode->used_size, 7))
-                {
-					if (CHECK_BIT(inode->dir_parent, 7) == 0)
-                    {
-                        uint8_t size = inode->used_size & 0x7F;
-                        if (size > 0)
-                        {
-                            if ((block_num >= inode->start_block) && (block_num <= (inode->start_block + size - 1)))
-                            {
-								if (CHECK_BIT(fb_byte, 7 - j) == 0)
-								{
-									// Used block marked not used in free block list
-									close(fd);
-									fprintf(stderr, "Error: File system in %s is inconsistent (error code: 1)\n", new_disk_name);
-                                    return;
-                                }
-                                if (used)
-                                {
-									// Block marked used for two files
-									close(fd);
-									fprintf(stderr, "Error: File system in %s is inconsistent (error code: 1)\n", new_disk_name);
-                                    return;
-                                }
-                                used = 1;
-                            }
-                        }
-                    }
-                }
-            }
+		if ((component.empty()) || (component == "."))
+		{
+			continue;
+		}
 
-			// Unused block marked used in free block list
-			if (CHECK_BIT(fb_byte, 7 - j) && (used == 0))
-            {
-				close(fd);
-				fprintf(stderr, "Error: File system in %s is inconsistent (error code: 1)\n", new_disk_name);
-                return;
-            }
-        }
-    }
+		if ((index != FS_ROOT) && (CHECK_FLAG(fs_sb.inode[index].dir_parent) == 0))
+		{
+			// Only the last component can be a file
+			return -1;
+		}
 
-    // Consistency Check 2
-    for (uint8_t i = 0; i < 126; i++)
-    {
-        Inode *inode = &new_fs_sb.inode[i];
-        if (CHECK_BIT(inode->used_size, 7))
-        {
-			uint8_t parent = inode->dir_parent & 0x7F;
-			for (uint8_t j = 0; j < 126; j++)
-            {
-                if (i != j)
-                {
-                    Inode *cmp_inode = &new_fs_sb.inode[j];
-                    if (CHECK_BIT(cmp_inode->used_size, 7))
-                    {
-						uint8_t cmp_parent = cmp_inode->dir_parent & 0x7F;
-						if (parent == cmp_parent)
-						{
-							if (strncmp(inode->name, cmp_inode->name, 5) == 0)
-	                        {
-								// Two files with same name in same directory
-								close(fd);
-								fprintf(stderr, "Error: File system in %s is inconsistent (error code: 2)\n", new_disk_name);
-	                            return;
-	                        }
-						}
-                    }
-                }
-            }
-        }
-    }
+		if (component == "..")
+		{
+			if (index != FS_ROOT)
+			{
+				index = fs_sb.inode[index].dir_parent & FS_MASK;
+			}
+			continue;
+		}
 
-    // Consistency Check 3
-    for (uint8_t i = 0; i < 126; i++)
-    {
-        Inode *inode = &new_fs_sb.inode[i];
-        if (CHECK_BIT(inode->used_size, 7) == 0)
-        {
-            for (uint8_t i = 0; i < 5; i++)
-            {
-                if (inode->name[i] != '\0')
-                {
-					// Non-zero characters in name for unused inode
-					close(fd);
-					fprintf(stderr, "Error: File system in %s is inconsistent (error code: 3)\n", new_disk_name);
-                    return;
-                }
-            }
+		if (component.size() > FS_NAME_LEN)
+		{
+			return -1;
+		}
 
-            if ((inode->used_size != 0) || (inode->start_block != 0) || (inode->dir_parent != 0))
-            {
-				// Non-zero parameters for unused inode
-				close(fd);
-				fprintf(stderr, "Error: File system in %s is inconsistent (error code: 3)\n", new_disk_name);
-                return;
-            }
-        }
-        else
-        {
-            uint8_t non_zero_present = 0;
+		index = fs_search_dir(index, component.c_str());
+		if (index < 0)
+		{
+			return -1;
+		}
+	}
 
-            for (uint8_t i = 0; i < 5; i++)
-            {
-                if (inode->name[i] != '\0')
-                {
-                    non_zero_present = 1;
-                    break;
-                }
-            }
+	return index;
+}
 
-            if (non_zero_present == 0)
-            {
-				// All zero characters in name for used inode
-				close(fd);
-				fprintf(stderr, "Error: File system in %s is inconsistent (error code: 3)\n", new_disk_name);
-                return;
-            }
-        }
-    }
 
-    // Consistency Check 4
-    for (uint8_t i = 0; i < 126; i++)
-    {
-        Inode *inode = &new_fs_sb.inode[i];
-        if (CHECK_BIT(inode->used_size, 7))
-        {
-			if (CHECK_BIT(inode->dir_parent, 7) == 0)
-            {
-                if ((inode->start_block < 1) || (inode->start_block > 127))
-                {
-					// Invalid start block for file
-					close(fd);
-					fprintf(stderr, "Error: File system in %s is inconsistent (error code: 4)\n", new_disk_name);
-                    return;
-                }
-            }
-        }
-    }
+/**
+* @brief 	Set bits to value in free block list of disk superblock
+* @param 	start_block - first block to set to value
+* @param 	end_block - end block to set to value
+* @param 	value - 0 or 1
+*/
+void fs_set_free_blocks(uint8_t start_block, uint8_t end_block, uint8_t value)
+{
+	Fs_geometry::set_blocks(fs_sb.free_block_list, start_block, end_block, value);
+}
 
-    // Consistency Check 5
-    for (uint8_t i = 0; i < 126; i++)
-    {
-        Inode *inode = &new_fs_sb.inode[i];
-        if (CHECK_BIT(inode->used_size, 7))
-        {
-            if (CHECK_BIT(inode->dir_parent, 7))
-            {
-                uint8_t size = inode->used_size & 0x7F;
-                if ((inode->start_block != 0) || (size != 0))
-                {
-					// Non-zero start block or size for directory
-					close(fd);
-					fprintf(stderr, "Error: File system in %s is inconsistent (error code: 5)\n", new_disk_name);
-                    return;
-                }
-            }
-        }
-    }
 
-    // Consistency Check 6
-    for (uint8_t i = 0; i < 126; i++)
-    {
-        Inode *inode = &new_fs_sb.inode[i];
-        if (CHECK_BIT(inode->used_size, 7))
-        {
-            uint8_t parent = inode->dir_parent & 0x7F;
+/**
+* @brief 	Check if inode belongs to a mapped file
+* @param 	inode - inode to check
+* @return 	1 if mapped file, otherwise 0
+*/
+uint8_t fs_is_mapped(const Inode *inode)
+{
+	return (CHECK_FLAG(inode->dir_parent) == 0) && ((inode->used_size & FS_MASK) == 0);
+}
 
-            if ((parent == 126) || (parent > 127))
-            {
-				// Invalid parent inode index
-				close(fd);
-				fprintf(stderr, "Error: File system in %s is inconsistent (error code: 6)\n", new_disk_name);
-                return;
-            }
 
-            if ((parent >= 0) && (parent <= 125))
-            {
-                Inode *parent_inode = &new_fs_sb.inode[parent];
-                if ((CHECK_BIT(parent_inode->used_size, 7) == 0) || (CHECK_BIT(parent_inode->dir_parent, 7) == 0))
-                {
-					// Invalid parent inode
-					close(fd);
-					fprintf(stderr, "Error: File system in %s is inconsistent (error code: 6)\n", new_disk_name);
-                    return;
-                }
-            }
-        }
-    }
+/**
+* @brief 	Get logical size of mapped file
+* @param 	map - block map of file
+* @return 	size of file in blocks
+*/
+uint8_t fs_map_size(const Block_map *map)
+{
+	return map->size & FS_MASK;
+}
 
-	if (fs_fd >= 0)
+
+/**
+* @brief 	Check if mapped file allocates blocks when they are first written
+* @param 	map - block map of file
+* @return 	1 if file was created sparse, 0 if its blocks are allocated up front
+*/
+uint8_t fs_map_sparse(const Block_map *map)
+{
+	return CHECK_FLAG(map->size) != 0;
+}
+
+
+/**
+* @brief 	Get logical size of file
+* @param 	inode_index - index of file inode
+* @return 	size of file in blocks
+*/
+uint8_t fs_file_size(uint8_t inode_index)
+{
+	Inode *inode = &fs_sb.inode[inode_index];
+	if (fs_is_mapped(inode))
 	{
-		// Unmount old file system
-		close(fs_fd);
-		dir_map.clear();
+		return fs_map_size(&file_maps[inode_index]);
 	}
 
-	// Mount new file system
-	fs_fd = fd;
-    fs_sb = new_fs_sb;
-	strcpy(disk_name, new_disk_name);
-
-	// Set current directory to root directory
-    curr_dir = 127;
+	return inode->used_size & FS_MASK;
+}
 
-	// Generate directory map for new file_system
-    dir_map.insert(std::pair< uint8_t, std::set<uint8_t> >(curr_dir, std::set<uint8_t>()));
-    for (uint8_t i = 0; i < 126; i++)
-    {
-        Inode *inode = &fs_sb.inode[i];
-        if (CHECK_BIT(inode->used_size, 7))
-        {
-			uint8_t parent = inode->dir_parent & 0x7F;
 
-			if (CHECK_BIT(inode->dir_parent, 7) == 0)
-            {
-				if (dir_map.find(parent) == dir_map.end())
-				{
-					dir_map.insert(std::pair< uint8_t, std::set<uint8_t> >(parent, std::set<uint8_t>()));
-				}
-            }
-			else if (dir_map.find(i) == dir_map.end())
-			{
-				dir_map.insert(std::pair< uint8_t, std::set<uint8_t> >(i, std::set<uint8_t>()));
-			}
+/**
+* @brief 	Get data block that holds a block of a file
+* @param 	inode_index - index of file inode
+* @param 	block_num - block number relative to start of file
+* @return 	0 if block has never been written, otherwise data block
+*/
+uint8_t fs_file_block(uint8_t inode_index, uint8_t block_num)
+{
+	Inode *inode = &fs_sb.inode[inode_index];
+	if (fs_is_mapped(inode))
+	{
+		return file_maps[inode_index].block[block_num];
+	}
 
-			dir_map[parent].insert(i);
-        }
-    }
+	return inode->start_block + block_num;
 }
 
 
 /**
-* @brief 	Create file with provided name and size
-* @param 	name - file name
-* @param 	size - file size
+* @brief 	Count data blocks written through block map
+* @param 	map - block map of file
+* @return 	number of written blocks
 */
-void fs_create(char name[5], int size)
+uint8_t fs_map_allocated(const Block_map *map)
 {
-	if (fs_fd < 0)
+	uint8_t allocated = 0;
+	for (uint8_t i = 0; i < fs_map_size(map); i++)
 	{
-		// No file system mounted
-		fprintf(stderr, "Error: No file system is mounted\n");
-		return;
+		if (map->block[i] != 0)
+		{
+			allocated++;
+		}
 	}
+	return allocated;
+}
 
-	for (uint8_t i = 0; i < 126; i++)
-    {
-        Inode *inode = &fs_sb.inode[i];
-		if (CHECK_BIT(inode->used_size, 7) == 0)
+
+/**
+* @brief 	Count data blocks allocated to file
+* @param 	inode_index - index of file inode
+* @return 	number of allocated data blocks, excluding the block map
+*/
+uint8_t fs_file_allocated(uint8_t inode_index)
+{
+	Inode *inode = &fs_sb.inode[inode_index];
+	if (fs_is_mapped(inode))
+	{
+		return fs_map_allocated(&file_maps[inode_index]);
+	}
+
+	return inode->used_size & FS_MASK;
+}
+
+
+/**
+* @brief 	Count references to a block from a block map
+* @param 	map - block map of file
+* @param 	map_block - block that holds the block map
+* @param 	block_num - block to count references to
+* @return 	number of references
+*/
+uint8_t fs_map_owns(Block_map *map, uint8_t map_block, uint8_t block_num)
+{
+	uint8_t owned = (map_block == block_num);
+	for (uint8_t i = 0; i < FS_MAP_ENTRIES; i++)
+	{
+		if (map->block[i] == block_num)
 		{
-			if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0))
-			{
-				// Reserved names
-				fprintf(stderr, "Error: File or directory %s already exists\n", name);
-				return;
-			}
+			owned++;
+		}
+	}
 
-			if (fs_search_curr_dir(name) >= 0)
-			{
-				// Duplicate file name
-				fprintf(stderr, "Error: File or directory %s already exists\n", name);
-				return;
-			}
+	return owned;
+}
 
-			uint8_t start_block_num = 0;
 
-			if (size > 0)
-			{
-				uint8_t found_space = 0;
+/**
+* @brief 	Get blocks, files and directories an inode adds to its parent
+* @param 	inode_index - index of inode
+* @return 	usage of inode itself, excluding children of a directory
+*/
+Dir_usage fs_inode_usage(uint8_t inode_index)
+{
+	Dir_usage usage = {0, 0, 0};
+	Inode *inode = &fs_sb.inode[inode_index];
 
-				for (uint8_t j = 0; j < 16; j++)
-				{
-					char fb_byte = fs_sb.free_block_list[j];
+	if (CHECK_FLAG(inode->dir_parent))
+	{
+		usage.dirs = 1;
+	}
+	else
+	{
+		usage.files = 1;
+		usage.blocks = fs_file_allocated(inode_index) + fs_is_mapped(inode);
+	}
 
-					for (uint8_t k = 0; k < 8; k++)
-					{
-						uint8_t block_num = (j * 8) + k;
-						if (CHECK_BIT(fb_byte, 7 - k) == 0)
-						{
-							if (start_block_num == 0)
-							{
-								// First empty block
-								start_block_num = block_num;
-							}
+	return usage;
+}
 
-							if ((start_block_num + size - 1) == block_num)
-							{
-								// Reserve blocks in free block list
-								fs_set_free_blocks(start_block_num, block_num, 1);
-								found_space = 1;
-								break;
-							}
-						}
-						else
-						{
-							start_block_num = 0;
-						}
-					}
 
-					if (found_space)
-					{
-						break;
-					}
-				}
+/**
+* @brief 	Add usage to directory and all directories above it
+* @param 	dir - index of directory inode, FS_ROOT for root directory
+* @param 	usage - usage to add
+* @param 	sign - 1 to add usage, -1 to remove it
+*/
+void fs_usage_add(uint8_t dir, Dir_usage usage, int sign)
+{
+	while (1)
+	{
+		Dir_usage *totals = &dir_usage[dir];
+		totals->blocks += sign * usage.blocks;
+		totals->files += sign * usage.files;
+		totals->dirs += sign * usage.dirs;
 
-				if (found_space == 0)
-				{
-					// Not enough contiguous empty blocks
-					fprintf(stderr, "Error: Cannot allocate %d on %s\n", size, disk_name);
-					return;
-				}
+		if ((dir == FS_ROOT) || (dir == FS_ORPHAN))
+		{
+			break;
+		}
+		dir = fs_sb.inode[dir].dir_parent & FS_MASK;
+	}
+}
 
-				inode->dir_parent = curr_dir;
-			}
-			else
-			{
-				// Add directory to directory map
-				dir_map.insert(std::pair< uint8_t, std::set<uint8_t> >(i, std::set<uint8_t>()));
-				inode->dir_parent = 0x80 | curr_dir;
-			}
 
-			// Set inode parameters
-			strncpy(inode->name, name, 5);
-			inode->used_size = 0x80 | size;
-			inode->start_block = start_block_num;
+/**
+* @brief 	Check if data block is shared by more than one block map entry
+* @param 	block_num - data block
+* @return 	1 if block is shared, otherwise 0
+*/
+uint8_t fs_is_shared(uint8_t block_num)
+{
+	return block_refs.find(block_num) != block_refs.end();
+}
 
-			// Update superblock on disk
-			lseek(fs_fd, 0, SEEK_SET);
-			write(fs_fd, fs_sb.free_block_list, 16);
-			lseek(fs_fd, (i + 2) * 8, SEEK_SET);
-			write(fs_fd, inode, 8);
 
-			dir_map[curr_dir].insert(i);
+/**
+* @brief 	Add block map entry pointing to data block
+* @param 	block_num - data block
+*/
+void fs_add_ref(uint8_t block_num)
+{
+	std::map< uint8_t, uint16_t >::iterator it = block_refs.find(block_num);
+	if (it == block_refs.end())
+	{
+		block_refs[block_num] = 2;
+	}
+	else
+	{
+		it->second++;
+	}
+}
 
-			return;
+
+/**
+* @brief 	Drop block map entry pointing to data block, deleting data and
+* 			freeing block once no other entry points to it
+* @param 	block_num - data block
+* @param 	empty_buff - zero block
+* @return 	1 if block was freed, otherwise 0
+*/
+uint8_t fs_drop_block(uint8_t block_num, const uint8_t *empty_buff)
+{
+	std::map< uint8_t, uint16_t >::iterator it = block_refs.find(block_num);
+	if (it != block_refs.end())
+	{
+		// Other files still read block
+		if (--it->second < 2)
+		{
+			block_refs.erase(it);
 		}
+		return 0;
 	}
 
-	// No available inode
-	fprintf(stderr, "Error: Superblock in disk %s is full, cannot create %s\n", disk_name, name);
+	io_write_block(block_num, empty_buff);
+	fs_set_free_blocks(block_num, block_num, 0);
+	return 1;
 }
 
 
 /**
-* @brief 	Deletes files and directories recursively
-* @param 	inode_index - index of inode to be deleted
+* @brief 	Count block map entries pointing to each data block
 */
-void fs_delete_r(uint8_t inode_index)
+void fs_count_refs(void)
 {
-	Inode *inode = &fs_sb.inode[inode_index];
+	uint16_t refs[FS_BLOCK_COUNT];
+	memset(refs, 0, sizeof(refs));
+	for (std::map< uint8_t, Block_map >::iterator it = file_maps.begin(); it != file_maps.end(); it++)
+	{
+		for (uint8_t i = 0; i < fs_map_size(&it->second); i++)
+		{
+			refs[it->second.block[i]]++;
+		}
+	}
 
-	if (CHECK_BIT(inode->dir_parent, 7))
+	block_refs.clear();
+	for (int i = 1; i < FS_BLOCK_COUNT; i++)
 	{
-		// Recusively delete directories and files within directory
-		while(!dir_map[inode_index].empty())
+		if (refs[i] > 1)
 		{
-			std::set<uint8_t>::iterator it = dir_map[inode_index].begin();
-			fs_delete_r(*it);
+			block_refs[i] = refs[i];
 		}
+	}
+}
+
+
+/**
+* @brief 	Check if inode is below a detached directory or is one
+* @param 	inode_index - index of inode
+* @return 	1 if inode is detached, otherwise 0
+*/
+uint8_t fs_is_detached(uint8_t inode_index)
+{
+	uint8_t dir = fs_sb.inode[inode_index].dir_parent & FS_MASK;
+	while ((dir != FS_ROOT) && (dir != FS_ORPHAN))
+	{
+		dir = fs_sb.inode[dir].dir_parent & FS_MASK;
+	}
+
+	return dir == FS_ORPHAN;
+}
+
+
+/**
+* @brief 	Free blocks of file or empty directory and remove it from its
+* 			directory, without writing superblock to disk
+* @param 	inode_index - index of inode
+*/
+void fs_release(uint8_t inode_index)
+{
+	Inode *inode = &fs_sb.inode[inode_index];
+	Dir_usage usage = fs_inode_usage(inode_index);
+
+	if (CHECK_FLAG(inode->dir_parent))
+	{
 		dir_map.erase(inode_index);
+		dir_usage.erase(inode_index);
+		dir_goal.erase(inode_index);
+	}
+	else if (fs_is_mapped(inode))
+	{
+		// Delete written blocks and block map of mapped file
+		Block_map *map = &file_maps[inode_index];
+		const uint8_t *empty_buff = io_zero_block();
+		for (uint8_t i = 0; i < fs_map_size(map); i++)
+		{
+			if (map->block[i] != 0)
+			{
+				fs_drop_block(map->block[i], empty_buff);
+			}
+		}
+		io_write_block(inode->start_block, empty_buff);
+		fs_set_free_blocks(inode->start_block, inode->start_block, 0);
+		file_maps.erase(inode_index);
 	}
 	else
 	{
 		// Delete file data
-		size_t size = inode->used_size & 0x7F;
-		uint8_t empty_buff[1024] = {0};
+		size_t size = inode->used_size & FS_MASK;
+		const uint8_t *empty_buff = io_zero_block();
 		for (uint8_t i = 0; i < size; i++)
 		{
-			lseek(fs_fd, (inode->start_block + i) * 1024, SEEK_SET);
-			write(fs_fd, empty_buff, 1024);
+			io_write_block(inode->start_block + i, empty_buff);
 		}
-
-		// Update free block list on disk
 		fs_set_free_blocks(inode->start_block, inode->start_block + size - 1, 0);
-		lseek(fs_fd, 0, SEEK_SET);
-		write(fs_fd, fs_sb.free_block_list, 16);
 	}
 
 	// Delete from parent directory
-	uint8_t parent = inode->dir_parent & 0x7F;
+	uint8_t parent = inode->dir_parent & FS_MASK;
 	dir_map[parent].erase(inode_index);
+	fs_index_remove(inode_index);
+	fs_usage_add(parent, usage, -1);
+	read_streams.erase(inode_index);
 
 	// Delete inode
-	memset(inode->name, 0, 5);
+	memset(inode->name, 0, FS_NAME_LEN);
 	inode->used_size = 0;
 	inode->start_block = 0;
 	inode->dir_parent = 0;
-
-	// Update inode on disk
-	lseek(fs_fd, (inode_index + 2) * 8, SEEK_SET);
-	write(fs_fd, inode, 8);
 }
 
 
 /**
-* @brief 	Deletes files and directories
-* @param 	name - index of file or directory to be deleted
+* @brief 	Free files and directories of detached directories, children
+* 			before their directory, then write free block list once and
+* 			each freed inode
+* @param 	count - max number of inodes to free, RECLAIM_ALL for every one
+* @return 	number of inodes freed
 */
-void fs_delete(char name[5])
+int fs_reclaim(int count)
 {
-	if (fs_fd < 0)
+	std::map< uint8_t, std::set<uint8_t> >::iterator orphans = dir_map.find(FS_ORPHAN);
+	if ((fs_fd < 0) || (orphans == dir_map.end()))
 	{
-		// No file system mounted
-		fprintf(stderr, "Error: No file system is mounted\n");
-		return;
+		return 0;
 	}
 
-	int inode_index = fs_search_curr_dir(name);
-	if (inode_index < 0)
+	std::vector<uint8_t> freed;
+	while (((count == RECLAIM_ALL) || ((int) freed.size() < count)) && !orphans->second.empty())
 	{
-		// Cannot find file or directory with given name
-		fprintf(stderr, "Error: File or directory %s does not exist\n", name);
-		return;
+		// A directory is freed once it is empty, so a crash never leaves an
+		// inode whose parent was freed
+		uint8_t leaf = *orphans->second.begin();
+		while (CHECK_FLAG(fs_sb.inode[leaf].dir_parent) && !dir_map[leaf].empty())
+		{
+			leaf = *dir_map[leaf].begin();
+		}
+
+		fs_release(leaf);
+		freed.push_back(leaf);
 	}
 
-	// Delete file or directory recursively
-	fs_delete_r((uint8_t) inode_index);
+	if (orphans->second.empty())
+	{
+		dir_map.erase(orphans);
+		dir_usage.erase(FS_ORPHAN);
+	}
+
+	if (!freed.empty())
+	{
+		// Handles of detached files were closed when they were detached
+		io_write(fs_sb.free_block_list, FS_FREE_LIST_SIZE, 0);
+		for (size_t i = 0; i < freed.size(); i++)
+		{
+			io_write(&fs_sb.inode[freed[i]], sizeof(Inode), Fs_geometry::INODE_OFFSET + (freed[i] * sizeof(Inode)));
+		}
+	}
+
+	return freed.size();
 }
 
 
 /**
-* @brief 	Read block from file
-* @param 	name - file to read from
-* @param	block_num - block number relative to start block of file
+* @brief 	Get goal block of directory, after the last block of its files or,
+* 			for a directory without blocks, in the middle of the longest free
+* 			run so the directory before the run has room to grow
+* @param 	dir - index of directory inode
+* @return 	goal block
 */
-void fs_read(char name[5], int block_num)
+int fs_dir_goal(uint8_t dir)
 {
-	if (fs_fd < 0)
+	std::map< uint8_t, int >::iterator it = dir_goal.find(dir);
+	if (it != dir_goal.end())
 	{
-		// No file system mounted
-		fprintf(stderr, "Error: No file system is mounted\n");
-		return;
+		return it->second;
 	}
 
-	int inode_index = fs_search_curr_dir(name);
-	if (inode_index < 0)
+	int goal = 0;
+	for (std::set<uint8_t>::iterator child = dir_map[dir].begin(); child != dir_map[dir].end(); child++)
 	{
-		// Cannot find file with given name
-		fprintf(stderr, "Error: File %s does not exist\n", name);
-		return;
-	}
+		Inode *inode = &fs_sb.inode[*child];
+		if (CHECK_FLAG(inode->dir_parent))
+		{
+			continue;
+		}
 
-	Inode *inode = &fs_sb.inode[inode_index];
-	if (CHECK_BIT(inode->dir_parent, 7))
-	{
-		// Given name belongs to directory
-		fprintf(stderr, "Error: File %s does not exist\n", name);
-		return;
+		int last = inode->start_block + fs_file_size(*child) - 1;
+		if (fs_is_mapped(inode))
+		{
+			last = inode->start_block;
+			for (uint8_t i = 0; i < file_maps[*child].size; i++)
+			{
+				last = (file_maps[*child].block[i] > last) ? file_maps[*child].block[i] : last;
+			}
+		}
+		goal = (last + 1 > goal) ? last + 1 : goal;
 	}
 
-	if (block_num >= (inode->used_size & 0x7F))
+	if ((goal == 0) || (goal >= FS_BLOCK_COUNT))
 	{
-		// Block number is outside file blocks
-		fprintf(stderr, "Error: %s does not have block %d\n", name, block_num);
-		return;
+		uint32_t len;
+		goal = Fs_geometry::longest_run(fs_sb.free_block_list, &len);
+		goal = (goal > 1) ? goal + (len / 2) : 1;
 	}
 
-	// Read block into buffer
-	lseek(fs_fd, (inode->start_block + block_num) * 1024, SEEK_SET);
-	read(fs_fd, data_buffer, 1024);
+	dir_goal[dir] = goal;
+	return goal;
 }
 
 
 /**
-* @brief 	Write block to file
-* @param 	name - file to write to
-* @param	block_num - block number relative to start block of file
+* @brief 	Find run of free blocks for file of directory, at or after the
+* 			goal block of the directory in locality mode, otherwise the first
+* 			run of the disk
+* @param 	count - number of blocks in run
+* @param 	dir - index of directory inode of file
+* @return 	0 if no run is free, otherwise first block of run
 */
-void fs_write(char name[5], int block_num)
+uint8_t fs_find_run(uint8_t count, uint8_t dir)
 {
-	if (fs_fd < 0)
+	uint8_t start_block = locality_mode ? Fs_geometry::find_run_near(fs_sb.free_block_list, count, fs_dir_goal(dir)) :
+		Fs_geometry::find_run(fs_sb.free_block_list, count);
+	if ((start_block == 0) && fs_reclaim(RECLAIM_ALL))
 	{
-		// No file system mounted
-		fprintf(stderr, "Error: No file system is mounted\n");
-		return;
-	}
-
-	int inode_index = fs_search_curr_dir(name);
-	if (inode_index < 0)
-	{
-		// Cannot find file with given name
-		fprintf(stderr, "Error: File %s does not exist\n", name);
-		return;
-	}
-
-	Inode *inode = &fs_sb.inode[inode_index];
-	if (CHECK_BIT(inode->dir_parent, 7))
-	{
-		// Given name belongs to directory
-		fprintf(stderr, "Error: File %s does not exist\n", name);
-		return;
+		// Blocks of detached directories are returned once they are needed
+		return fs_find_run(count, dir);
 	}
 
-	if (block_num >= (inode->used_size & 0x7F))
+	if ((start_block != 0) && locality_mode)
 	{
-		// Block number is outside file blocks
-		fprintf(stderr, "Error: %s does not have block %d\n", name, block_num);
-		return;
+		dir_goal[dir] = start_block + count;
 	}
 
-	// Write buffer to block
-	lseek(fs_fd, (inode->start_block + block_num) * 1024, SEEK_SET);
-	write(fs_fd, data_buffer, 1024);
+	return start_block;
 }
 
 
 /**
-* @brief 	Flush and fill buffer with provided data
-* @param 	buff - provided data
+* @brief 	Reserve free block for file of directory
+* @param 	dir - index of directory inode of file
+* @return 	0 if no block is free, otherwise reserved block
 */
-void fs_buff(uint8_t buff[1024])
+uint8_t fs_alloc_block(uint8_t dir)
 {
-	if (fs_fd < 0)
+	uint8_t block_num = fs_find_run(1, dir);
+	if (block_num != 0)
 	{
-		// No file system mounted
-		fprintf(stderr, "Error: No file system is mounted\n");
-		return;
+		fs_set_free_blocks(block_num, block_num, 1);
 	}
 
-	// Flush and copy data into buffer
-	memset(data_buffer, 0, 1024);
-	memcpy(data_buffer, buff, strlen((char *) buff));
+	return block_num;
 }
 
 
 /**
-* @brief 	Print files and directories in current directory
+* @brief 	Give block of mapped file its own data block before it is
+* 			written, leaving shared block to the other files pointing to it
+* @param 	inode_index - index of mapped file inode
+* @param 	block_num - block number relative to start of file
+* @param 	copy - 1 to copy data of shared block, 0 if whole block is written
+* @return 	0 if no block is free, otherwise new data block
 */
-void fs_ls(void)
+uint8_t fs_unshare_block(uint8_t inode_index, uint8_t block_num, uint8_t copy)
 {
-	if (fs_fd < 0)
+	uint8_t shared_block = file_maps[inode_index].block[block_num];
+	uint8_t data_block = fs_alloc_block(fs_sb.inode[inode_index].dir_parent & FS_MASK);
+	if (data_block == 0)
 	{
-		// No file system mounted
-		fprintf(stderr, "Error: No file system is mounted\n");
-		return;
+		return 0;
 	}
 
-	// Number of children in current directory
-	int num_of_children = dir_map[curr_dir].size() + 2;
-	printf("%-5s %3d\n", ".", num_of_children);
-
-	// Number of children in parent directory
-	if (curr_dir != 127)
+	if (copy)
 	{
-		Inode *inode = &fs_sb.inode[curr_dir];
-		uint8_t parent = inode->dir_parent & 0x7F;
-		num_of_children = dir_map[parent].size() + 2;
+		uint8_t *buff = io_alloc_block();
+		io_read_block(shared_block, buff);
+		io_write_block(data_block, buff);
+		io_free_block(buff);
 	}
-	printf("%-5s %3d\n", "..", num_of_children);
 
-	if (!dir_map[curr_dir].empty())
-	{
-		char name[6];
-		for (std::set<uint8_t>::iterator it = dir_map[curr_dir].begin(); it != dir_map[curr_dir].end(); it++)
-		{
-			Inode *inode = &fs_sb.inode[*it];
+	fs_drop_block(shared_block, io_zero_block());
+	file_maps[inode_index].block[block_num] = data_block;
+	return data_block;
+}
 
-			strncpy(name, inode->name, 5);
-			name[5] = 0;
 
-			if (CHECK_BIT(inode->dir_parent, 7))
-			{
-				// Number of children in directory
-				num_of_children = dir_map[*it].size() + 2;
-				printf("%-5s %3d\n", name, num_of_children);
-			}
-			else
+/**
+* @brief 	Update cached inode parameters of handles bound to inode, and
+* 			close them if the inode was deleted
+* @param 	inode_index - index of inode
+*/
+void fs_refresh_handles(uint8_t inode_index)
+{
+	Inode *inode = &fs_sb.inode[inode_index];
+
+	for (uint8_t i = 0; i < MAX_HANDLES; i++)
+	{
+		File_handle *handle = &handles[i];
+		if (handle->open && (handle->inode_index == inode_index))
+		{
+			if (CHECK_FLAG(inode->used_size) == 0)
 			{
-				// Size of file
-				uint8_t size = inode->used_size & 0x7F;
-				printf("%-5s %3d KB\n", name, size);
+				// Handles of deleted file become invalid
+				handle->open = 0;
+				continue;
 			}
+
+			handle->mapped = fs_is_mapped(inode);
+			handle->start_block = inode->start_block;
+			handle->size = fs_file_size(inode_index);
 		}
 	}
 }
 
 
 /**
-* @brief 	Resize file of provided name with new size
-* @param 	name - file name
-* @param 	new_size - new file size
+* @brief 	Reserve free blocks for file of directory from as many free extents
+* 			as needed
+* @param 	count - number of blocks to reserve
+* @param 	blocks - array that will contain reserved blocks in allocation order
+* @param 	dir - index of directory inode of file
+* @return 	1 if reserved, 0 if not enough blocks are free
 */
-void fs_resize(char name[5], int new_size)
+uint8_t fs_alloc_extents(uint8_t count, uint8_t *blocks, uint8_t dir)
 {
-	if (fs_fd < 0)
+	if (Fs_geometry::count_free(fs_sb.free_block_list) < count)
 	{
-		// No file system mounted
-		fprintf(stderr, "Error: No file system is mounted\n");
-		return;
+		if (fs_reclaim(RECLAIM_ALL) == 0)
+		{
+			return 0;
+		}
+		return fs_alloc_extents(count, blocks, dir);
 	}
 
-	int inode_index = fs_search_curr_dir(name);
-	if (inode_index < 0)
+	for (uint8_t i = 0; i < count; i++)
 	{
-		// Cannot find file with given name
-		fprintf(stderr, "Error: File %s does not exist\n", name);
-		return;
+		blocks[i] = fs_alloc_block(dir);
 	}
 
-	Inode *inode = &fs_sb.inode[inode_index];
-	if (CHECK_BIT(inode->dir_parent, 7))
-	{
-		// Given name belongs to directory
-		fprintf(stderr, "Error: File %s does not exist\n", name);
+	return 1;
+}
+
+
+/**
+* @brief 	Move run of data blocks, reporting blocks that did not match their
+* 			checksum, which stay corrupt at their new place
+* @param 	from_block - first block of run
+* @param 	to_block - first block run is moved to
+* @param 	count - number of blocks in run
+*/
+void fs_move_blocks(uint8_t from_block, uint8_t to_block, uint8_t count)
+{
+	std::vector<uint8_t> corrupt;
+	if (io_move_blocks(from_block, to_block, count, corrupt) < 0)
+	{
+		for (size_t i = 0; i < corrupt.size(); i++)
+		{
+			fprintf(fs_err, "Error: Checksum mismatch in block %d of %s\n", corrupt[i], disk_name);
+		}
+	}
+}
+
+
+/**
+* @brief 	Write free block list of superblock to disk
+*/
+void fs_write_free_list(void)
+{
+	io_write(fs_sb.free_block_list, FS_FREE_LIST_SIZE, 0);
+}
+
+
+/**
+* @brief 	Write inode of superblock to disk
+* @param 	inode_index - index of inode
+*/
+void fs_write_inode(uint8_t inode_index)
+{
+	io_write(&fs_sb.inode[inode_index], sizeof(Inode), Fs_geometry::INODE_OFFSET + (inode_index * sizeof(Inode)));
+	fs_refresh_handles(inode_index);
+}
+
+
+/**
+* @brief 	Write block map of mapped file to disk
+* @param 	inode_index - index of file inode
+*/
+void fs_write_map(uint8_t inode_index)
+{
+	uint8_t *buff = io_alloc_block();
+	memset(buff, 0, FS_BLOCK_SIZE);
+	memcpy(buff, &file_maps[inode_index], sizeof(Block_map));
+
+	io_write_block(fs_sb.inode[inode_index].start_block, buff);
+	io_free_block(buff);
+	fs_refresh_handles(inode_index);
+}
+
+
+/**
+* @brief 	Get checksum of metadata covered by clean unmount record
+* @param 	sb - superblock of disk
+* @param 	maps - block maps of mapped files of disk
+* @param 	index - directory index
+* @return 	checksum
+*/
+uint32_t fs_meta_crc(Super_block *sb, std::map< uint8_t, Block_map > &maps, std::vector<uint8_t> &index)
+{
+	uint32_t crc = crc32c(0, sb, sizeof(Super_block));
+	for (std::map< uint8_t, Block_map >::iterator it = maps.begin(); it != maps.end(); it++)
+	{
+		crc = crc32c(crc, &it->first, 1);
+		crc = crc32c(crc, &it->second, sizeof(Block_map));
+	}
+
+	return index.empty() ? crc : crc32c(crc, &index[0], index.size());
+}
+
+
+/**
+* @brief 	Save clean unmount record of mounted disk
+* @param 	clean - 1 if disk is being unmounted, 0 if it is being mounted
+*/
+void fs_meta_write(uint8_t clean)
+{
+	if ((clean_mode == 0) || (fs_fd < 0) || fs_dev->overlay)
+	{
+		return;
+	}
+
+	// Directory index holds each directory followed by its child count and
+	// children
+	std::vector<uint8_t> index;
+	for (std::map< uint8_t, std::set<uint8_t> >::iterator it = dir_map.begin(); it != dir_map.end(); it++)
+	{
+		index.push_back(it->first);
+		index.push_back(it->second.size());
+		index.insert(index.end(), it->second.begin(), it->second.end());
+	}
+
+	Meta_header header;
+	memcpy(header.magic, META_MAGIC, 8);
+	header.clean = clean;
+	header.crc = fs_meta_crc(&fs_sb, file_maps, index);
+	header.index_size = index.size();
+
+	// Record is replaced at once so it is never seen half written
+	std::string name = std::string(disk_name) + ".meta";
+	std::string tmp_name = name + ".tmp";
+	FILE *fp = fopen(tmp_name.c_str(), "wb");
+	if (fp == NULL)
+	{
+		return;
+	}
+	fwrite(&header, 1, sizeof(header), fp);
+	fwrite(index.data(), 1, index.size(), fp);
+	if (fclose(fp) == 0)
+	{
+		rename(tmp_name.c_str(), name.c_str());
+	}
+}
+
+
+/**
+* @brief 	Check if disk was cleanly unmounted and has not changed since, and
+* 			load its directory index
+* @param 	name - name of disk
+* @param 	sb - superblock of disk
+* @param 	maps - block maps of mapped files of disk
+* @param 	saved_dir_map - directory map that will contain saved directory index
+* @return 	1 if disk can be trusted, otherwise 0
+*/
+uint8_t fs_meta_load(const char *name, Super_block *sb, std::map< uint8_t, Block_map > &maps,
+	std::map< uint8_t, std::set<uint8_t> > &saved_dir_map)
+{
+	FILE *fp = fopen((std::string(name) + ".meta").c_str(), "rb");
+	if (fp == NULL)
+	{
+		return 0;
+	}
+
+	Meta_header header;
+	std::vector<uint8_t> index;
+	uint8_t valid = (fread(&header, 1, sizeof(header), fp) == sizeof(header)) &&
+		(memcmp(header.magic, META_MAGIC, 8) == 0) && (header.clean == 1) && (header.index_size <= 2 * FS_BLOCK_SIZE);
+	if (valid)
+	{
+		index.resize(header.index_size);
+		valid = (fread(index.data(), 1, index.size(), fp) == index.size()) && (fs_meta_crc(sb, maps, index) == header.crc);
+	}
+	fclose(fp);
+
+	if (valid == 0)
+	{
+		return 0;
+	}
+
+	for (size_t i = 0; i + 1 < index.size(); i += 2 + index[i + 1])
+	{
+		std::set<uint8_t> &children = saved_dir_map[index[i]];
+		for (size_t j = i + 2; (j < i + 2 + index[i + 1]) && (j < index.size()); j++)
+		{
+			children.insert(index[j]);
+		}
+	}
+
+	return 1;
+}
+
+
+/**
+* @brief 	Save block checksums of mounted disk, unless it is an overlay
+*/
+void fs_sums_write(void)
+{
+	if ((checksum_mode == 0) || (fs_fd < 0) || fs_dev->overlay)
+	{
+		return;
+	}
+
+	if (io_save_sums((std::string(disk_name) + ".sum").c_str()) < 0)
+	{
+		fprintf(fs_err, "Error: Cannot save checksums of %s\n", disk_name);
+	}
+}
+
+
+/**
+* @brief 	Perform consistency checks on superblock and block maps of disk
+* @param 	sb - superblock of disk
+* @param 	maps - block maps of mapped files of disk
+* @return 	0 if consistent, otherwise error code of failed check
+*/
+uint8_t fs_check(Super_block *sb, std::map< uint8_t, Block_map > &maps)
+{
+    // Consistency Check 1
+    for (uint8_t i = 0; i < FS_FREE_LIST_SIZE; i++)
+    {
+		char fb_byte = sb->free_block_list[i];
+        for (uint8_t j = 0; j < 8; j++)
+        {
+            if ((i == 0) && (j == 0))
+            {
+				if (CHECK_BIT(fb_byte, 7 - j) == 0)
+                {
+					// Superblock marked not used in free block list
+					return 1;
+                }
+                continue;
+            }
+
+            uint8_t block_num = (i * 8) + j;
+            uint8_t used = 0;
+            uint8_t referenced = 0;  // Block map entries may share data blocks
+
+            for (uint8_t k = 0; k < FS_INODE_COUNT; k++)
+            {
+                Inode *inode = &sb->inode[k];
+				if (CHECK_FLAG(inode->used_size))
+                {
+					if (CHECK_FLAG(inode->dir_parent) == 0)
+                    {
+                        uint8_t size = inode->used_size & FS_MASK;
+                        if (size > 0)
+                        {
+                            if ((block_num >= inode->start_block) && (block_num <= (inode->start_block + size - 1)))
+                            {
+								if (CHECK_BIT(fb_byte, 7 - j) == 0)
+								{
+									// Used block marked not used in free block list
+									return 1;
+                                }
+                                if (used || referenced)
+                                {
+									// Block marked used for two files
+									return 1;
+                                }
+                                used = 1;
+                            }
+                        }
+                        else if (maps.find(k) != maps.end())
+                        {
+							uint8_t owned = fs_map_owns(&maps[k], inode->start_block, block_num);
+							if (owned)
+							{
+								if (CHECK_BIT(fb_byte, 7 - j) == 0)
+								{
+									// Used block marked not used in free block list
+									return 1;
+								}
+								if (inode->start_block == block_num)
+								{
+									if (used || referenced || (owned > 1))
+									{
+										// Block map shares block with a file or block map
+										return 1;
+									}
+									used = 1;
+								}
+								else if (used)
+								{
+									// Data block shared with a block map or contiguous file
+									return 1;
+								}
+								else
+								{
+									referenced = 1;
+								}
+							}
+                        }
+                    }
+                }
+            }
+
+			// Unused block marked used in free block list
+			if (CHECK_BIT(fb_byte, 7 - j) && (used == 0) && (referenced == 0))
+            {
+				return 1;
+            }
+        }
+    }
+
+    // Consistency Check 2
+    for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+    {
+        Inode *inode = &sb->inode[i];
+        if (CHECK_FLAG(inode->used_size))
+        {
+			uint8_t parent = inode->dir_parent & FS_MASK;
+			for (uint8_t j = 0; j < FS_INODE_COUNT; j++)
+            {
+                if (i != j)
+                {
+                    Inode *cmp_inode = &sb->inode[j];
+                    if (CHECK_FLAG(cmp_inode->used_size))
+                    {
+						uint8_t cmp_parent = cmp_inode->dir_parent & FS_MASK;
+						if ((parent == cmp_parent) && ((parent != FS_ORPHAN) || (orphan_mode == 0)))
+						{
+							if (strncmp(inode->name, cmp_inode->name, FS_NAME_LEN) == 0)
+	                        {
+								// Two files with same name in same directory
+								return 2;
+	                        }
+						}
+                    }
+                }
+            }
+        }
+    }
+
+    // Consistency Check 3
+    for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+    {
+        Inode *inode = &sb->inode[i];
+        if (CHECK_FLAG(inode->used_size) == 0)
+        {
+            for (uint8_t i = 0; i < FS_NAME_LEN; i++)
+            {
+                if (inode->name[i] != '\0')
+                {
+					// Non-zero characters in name for unused inode
+					return 3;
+                }
+            }
+
+            if ((inode->used_size != 0) || (inode->start_block != 0) || (inode->dir_parent != 0))
+            {
+				// Non-zero parameters for unused inode
+				return 3;
+            }
+        }
+        else
+        {
+            uint8_t non_zero_present = 0;
+
+            for (uint8_t i = 0; i < FS_NAME_LEN; i++)
+            {
+                if (inode->name[i] != '\0')
+                {
+                    non_zero_present = 1;
+                    break;
+                }
+            }
+
+            if (non_zero_present == 0)
+            {
+				// All zero characters in name for used inode
+				return 3;
+            }
+        }
+    }
+
+    // Consistency Check 4
+    for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+    {
+        Inode *inode = &sb->inode[i];
+        if (CHECK_FLAG(inode->used_size))
+        {
+			if (CHECK_FLAG(inode->dir_parent) == 0)
+            {
+                if ((inode->start_block < 1) || (inode->start_block >= FS_BLOCK_COUNT))
+                {
+					// Invalid start block for file
+					return 4;
+                }
+
+				if (fs_is_mapped(inode))
+				{
+					Block_map *map = &maps[i];
+					uint8_t valid = (fs_map_size(map) >= 1) && (fs_map_size(map) <= FS_MAP_ENTRIES);
+					for (uint8_t j = 0; j < FS_MAP_ENTRIES; j++)
+					{
+						if ((map->block[j] >= FS_BLOCK_COUNT) || ((j >= fs_map_size(map)) && (map->block[j] != 0)))
+						{
+							valid = 0;
+						}
+					}
+
+					if (valid == 0)
+					{
+						// Invalid block map for mapped file
+						return 4;
+					}
+				}
+            }
+        }
+    }
+
+    // Consistency Check 5
+    for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+    {
+        Inode *inode = &sb->inode[i];
+        if (CHECK_FLAG(inode->used_size))
+        {
+            if (CHECK_FLAG(inode->dir_parent))
+            {
+                uint8_t size = inode->used_size & FS_MASK;
+                if ((inode->start_block != 0) || (size != 0))
+                {
+					// Non-zero start block or size for directory
+					return 5;
+                }
+            }
+        }
+    }
+
+    // Consistency Check 6
+    for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+    {
+        Inode *inode = &sb->inode[i];
+        if (CHECK_FLAG(inode->used_size))
+        {
+            uint8_t parent = inode->dir_parent & FS_MASK;
+
+            // Detached directories wait on the orphan list to be reclaimed
+            uint8_t orphan = orphan_mode && (parent == FS_ORPHAN) && CHECK_FLAG(inode->dir_parent);
+            if ((parent >= FS_INODE_COUNT) && (parent != FS_ROOT) && (orphan == 0))
+            {
+				// Invalid parent inode index
+				return 6;
+            }
+
+            if (parent < FS_INODE_COUNT)
+            {
+                Inode *parent_inode = &sb->inode[parent];
+                if ((CHECK_FLAG(parent_inode->used_size) == 0) || (CHECK_FLAG(parent_inode->dir_parent) == 0))
+                {
+					// Invalid parent inode
+					return 6;
+                }
+            }
+        }
+    }
+
+	// Every parent is a used directory, so a walk that does not reach the
+	// root directory within one step per inode is caught in a cycle
+	for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+	{
+		uint8_t dir = i;
+		uint8_t steps = 0;
+		while ((dir < FS_INODE_COUNT) && CHECK_FLAG(sb->inode[dir].used_size) && (steps <= FS_INODE_COUNT))
+		{
+			dir = sb->inode[dir].dir_parent & FS_MASK;
+			steps++;
+		}
+
+		if (steps > FS_INODE_COUNT)
+		{
+			// Directories are parents of each other
+			return 6;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+* @brief 	Perform consistency checks on file system and mount if valid
+* @param 	new_disk_name - name of disk that contains file system to mount
+* @param 	delta_name - saved overlay delta to mount disk with, or NULL
+*/
+void fs_mount(char *new_disk_name, char *delta_name)
+{
+	// Mounted disk is left without detached directories
+	fs_reclaim(RECLAIM_ALL);
+
+	Io_device *dev = io_open(new_disk_name, overlay_mode || (delta_name != NULL), direct_mode, checksum_mode);
+    if (dev == NULL)
+    {
+		// Unable to open disk
+		fprintf(fs_err, "Error: Cannot find disk %s\n", new_disk_name);
+        return;
+    }
+
+	if (direct_mode && (dev->align == 0))
+	{
+		// File system of disk rejected O_DIRECT
+		fprintf(fs_err, "Warning: Direct I/O not supported for disk %s, using buffered I/O\n", new_disk_name);
+	}
+
+	if ((delta_name != NULL) && (io_load_delta(dev, delta_name) < 0))
+	{
+		// Unable to read saved overlay delta
+		io_close(dev);
+		fprintf(fs_err, "Error: Cannot load delta %s\n", delta_name);
+		return;
+	}
+
+	// Get superblock from disk
+	Super_block new_fs_sb;
+    io_dev_read(dev, &new_fs_sb, FS_BLOCK_SIZE, 0);
+
+	// Get block maps of mapped files from disk
+	std::map< uint8_t, Block_map > new_file_maps;
+	for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+	{
+		Inode *inode = &new_fs_sb.inode[i];
+		if (CHECK_FLAG(inode->used_size) && fs_is_mapped(inode))
+		{
+			if ((inode->start_block >= 1) && (inode->start_block < FS_BLOCK_COUNT))
+			{
+				Block_map map;
+				io_dev_read(dev, &map, sizeof(Block_map), inode->start_block * FS_BLOCK_SIZE);
+				new_file_maps[i] = map;
+			}
+		}
+	}
+
+	// Mounted file system is consistent between commands, so its record is
+	// saved before its own disk may be mounted again
+	fs_meta_write(1);
+
+	// Disk that was cleanly unmounted and has not changed is not checked
+	std::map< uint8_t, std::set<uint8_t> > saved_dir_map;
+	uint8_t trusted = clean_mode && fs_meta_load(new_disk_name, &new_fs_sb, new_file_maps, saved_dir_map);
+
+	uint8_t error_code = trusted ? 0 : fs_check(&new_fs_sb, new_file_maps);
+	if (error_code != 0)
+	{
+		io_close(dev);
+		fs_meta_write(0);
+		fprintf(fs_err, "Error: File system in %s is inconsistent (error code: %d)\n", new_disk_name, error_code);
+		return;
+	}
+
+	if (fs_fd >= 0)
+	{
+		// Unmount old file system
+		fs_sums_write();
+		io_detach();
+		io_close(fs_dev);
+		dir_map.clear();
+		dir_usage.clear();
+		dir_goal.clear();
+		name_index.clear();
+		read_streams.clear();
+		memset(handles, 0, sizeof(handles));
+	}
+
+	if (checksum_mode)
+	{
+		// Checksums are only saved at unmount, so a disk that was not
+		// unmounted has its checksums taken again as blocks are read
+		std::string sum_name = std::string(new_disk_name) + ".sum";
+		io_load_sums(dev, sum_name.c_str());
+		if (dev->overlay == 0)
+		{
+			unlink(sum_name.c_str());
+		}
+	}
+
+	// Mount new file system
+	fs_dev = dev;
+	fs_fd = dev->fd;
+	io_attach(dev);
+    fs_sb = new_fs_sb;
+	file_maps = new_file_maps;
+	fs_count_refs();
+	strcpy(disk_name, new_disk_name);
+	delta_path = (delta_name != NULL) ? delta_name : "";
+
+	// Set current directory to root directory
+    curr_dir = FS_ROOT;
+
+	// Generate directory map for new file_system, unless it was saved
+    dir_map.insert(std::pair< uint8_t, std::set<uint8_t> >(curr_dir, std::set<uint8_t>()));
+    if (trusted)
+    {
+        dir_map = saved_dir_map;
+    }
+    for (uint8_t i = 0; (i < FS_INODE_COUNT) && (trusted == 0); i++)
+    {
+        Inode *inode = &fs_sb.inode[i];
+        if (CHECK_FLAG(inode->used_size))
+        {
+			uint8_t parent = inode->dir_parent & FS_MASK;
+
+			if (CHECK_FLAG(inode->dir_parent) == 0)
+            {
+				if (dir_map.find(parent) == dir_map.end())
+				{
+					dir_map.insert(std::pair< uint8_t, std::set<uint8_t> >(parent, std::set<uint8_t>()));
+				}
+            }
+			else if (dir_map.find(i) == dir_map.end())
+			{
+				dir_map.insert(std::pair< uint8_t, std::set<uint8_t> >(i, std::set<uint8_t>()));
+			}
+
+			dir_map[parent].insert(i);
+        }
+    }
+
+	// Generate directory totals for new file system
+	dir_usage[FS_ROOT] = Dir_usage();
+	for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+	{
+		Inode *inode = &fs_sb.inode[i];
+		if (CHECK_FLAG(inode->used_size))
+		{
+			fs_usage_add(inode->dir_parent & FS_MASK, fs_inode_usage(i), 1);
+			if ((orphan_mode == 0) || (fs_is_detached(i) == 0))
+			{
+				fs_index_add(i);
+			}
+		}
+	}
+
+	// Record stays unclean until disk is unmounted
+	fs_meta_write(0);
+}
+
+
+/**
+* @brief 	Create file with provided name and size
+* @param 	name - file name
+* @param 	size - file size
+*/
+void fs_create(char name[5], int size)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+    {
+        Inode *inode = &fs_sb.inode[i];
+		if (CHECK_FLAG(inode->used_size) == 0)
+		{
+			if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0))
+			{
+				// Reserved names
+				fprintf(fs_err, "Error: File or directory %s already exists\n", name);
+				return;
+			}
+
+			if (fs_search_curr_dir(name) >= 0)
+			{
+				// Duplicate file name
+				fprintf(fs_err, "Error: File or directory %s already exists\n", name);
+				return;
+			}
+
+			uint8_t start_block_num = 0;
+			uint8_t mapped = 0;
+
+			if ((size > 0) && sparse_mode)
+			{
+				// Reserve only the block map of a sparse file
+				start_block_num = fs_alloc_block(curr_dir);
+				if (start_block_num == 0)
+				{
+					// No empty block for block map
+					fprintf(fs_err, "Error: Cannot allocate %d on %s\n", size, disk_name);
+					return;
+				}
+
+				Block_map map;
+				memset(&map, 0, sizeof(Block_map));
+				map.size = FS_FLAG | size;
+				file_maps[i] = map;
+				mapped = 1;
+
+				inode->dir_parent = curr_dir;
+			}
+			else if (size > 0)
+			{
+				// First run of empty blocks, near other files of directory in
+				// locality mode
+				start_block_num = fs_find_run(size, curr_dir);
+				uint8_t found_space = (start_block_num != 0);
+				if (found_space)
+				{
+					// Reserve blocks in free block list
+					fs_set_free_blocks(start_block_num, start_block_num + size - 1, 1);
+				}
+
+				if (found_space == 0)
+				{
+					// Not enough contiguous empty blocks, so spread file over
+					// free extents with a block map
+					uint8_t blocks[FS_BLOCK_COUNT];
+					if (fs_alloc_extents(size + 1, blocks, curr_dir) == 0)
+					{
+						// Not enough empty blocks
+						fprintf(fs_err, "Error: Cannot allocate %d on %s\n", size, disk_name);
+						return;
+					}
+
+					Block_map map;
+					memset(&map, 0, sizeof(Block_map));
+					map.size = size;
+					memcpy(map.block, &blocks[1], size);
+					file_maps[i] = map;
+					mapped = 1;
+					start_block_num = blocks[0];
+				}
+
+				inode->dir_parent = curr_dir;
+			}
+			else
+			{
+				// Add directory to directory map
+				dir_map.insert(std::pair< uint8_t, std::set<uint8_t> >(i, std::set<uint8_t>()));
+				inode->dir_parent = FS_FLAG | curr_dir;
+			}
+
+			// Set inode parameters
+			strncpy(inode->name, name, FS_NAME_LEN);
+			inode->used_size = mapped ? FS_FLAG : (FS_FLAG | size);
+			inode->start_block = start_block_num;
+
+			// Update superblock on disk
+			fs_write_free_list();
+			fs_write_inode(i);
+
+			if (mapped)
+			{
+				fs_write_map(i);
+			}
+
+			dir_map[curr_dir].insert(i);
+			fs_index_add(i);
+			if (CHECK_FLAG(inode->dir_parent))
+			{
+				dir_usage[i] = Dir_usage();
+			}
+			fs_usage_add(curr_dir, fs_inode_usage(i), 1);
+
+			return;
+		}
+	}
+
+	if (fs_reclaim(RECLAIM_ALL))
+	{
+		// Inodes of detached directories are returned once they are needed
+		fs_create(name, size);
+		return;
+	}
+
+	// No available inode
+	fprintf(fs_err, "Error: Superblock in disk %s is full, cannot create %s\n", disk_name, name);
+}
+
+
+/**
+* @brief 	Deletes files and directories recursively
+* @param 	inode_index - index of inode to be deleted
+*/
+void fs_delete_r(uint8_t inode_index)
+{
+	Inode *inode = &fs_sb.inode[inode_index];
+	uint8_t is_dir = CHECK_FLAG(inode->dir_parent);
+
+	if (is_dir)
+	{
+		// Recusively delete directories and files within directory
+		while(!dir_map[inode_index].empty())
+		{
+			std::set<uint8_t>::iterator it = dir_map[inode_index].begin();
+			fs_delete_r(*it);
+		}
+	}
+
+	fs_release(inode_index);
+
+	// Update free block list and inode on disk
+	if (is_dir == 0)
+	{
+		fs_write_free_list();
+	}
+	fs_write_inode(inode_index);
+}
+
+
+/**
+* @brief 	Remove directory and everything below it from name index and
+* 			close handles of its files
+* @param 	inode_index - index of inode
+*/
+void fs_forget_r(uint8_t inode_index)
+{
+	fs_index_remove(inode_index);
+	if (CHECK_FLAG(fs_sb.inode[inode_index].dir_parent))
+	{
+		std::set<uint8_t> &children = dir_map[inode_index];
+		for (std::set<uint8_t>::iterator it = children.begin(); it != children.end(); it++)
+		{
+			fs_forget_r(*it);
+		}
+		return;
+	}
+
+	for (uint8_t i = 0; i < MAX_HANDLES; i++)
+	{
+		if (handles[i].inode_index == inode_index)
+		{
+			handles[i].open = 0;
+		}
+	}
+}
+
+
+/**
+* @brief 	Detach directory from its parent onto the orphan list with a
+* 			single inode write, leaving its files to be reclaimed later
+* @param 	inode_index - index of directory inode
+*/
+void fs_detach(uint8_t inode_index)
+{
+	Inode *inode = &fs_sb.inode[inode_index];
+	uint8_t parent = inode->dir_parent & FS_MASK;
+
+	// Directory totals hold everything below directory but not itself
+	Dir_usage usage = dir_usage[inode_index];
+	usage.dirs++;
+	fs_usage_add(parent, usage, -1);
+	fs_usage_add(FS_ORPHAN, usage, 1);
+	fs_forget_r(inode_index);
+
+	dir_map[parent].erase(inode_index);
+	dir_map[FS_ORPHAN].insert(inode_index);
+
+	// Name is free in parent as soon as inode no longer points to it
+	inode->dir_parent = FS_FLAG | FS_ORPHAN;
+	fs_write_inode(inode_index);
+}
+
+
+/**
+* @brief 	Deletes files and directories
+* @param 	name - index of file or directory to be deleted
+*/
+void fs_delete(char name[5])
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	int inode_index = fs_search_curr_dir(name);
+	if (inode_index < 0)
+	{
+		// Cannot find file or directory with given name
+		fprintf(fs_err, "Error: File or directory %s does not exist\n", name);
+		return;
+	}
+
+	if (orphan_mode && CHECK_FLAG(fs_sb.inode[inode_index].dir_parent))
+	{
+		// Directory is reclaimed between later commands
+		fs_detach((uint8_t) inode_index);
+		return;
+	}
+
+	// Delete file or directory recursively
+	fs_delete_r((uint8_t) inode_index);
+}
+
+
+/**
+* @brief 	Track sequential reads of file and prefetch blocks ahead of reader
+* @param 	inode_index - index of file inode
+* @param	block_num - block number being read
+*/
+void fs_read_ahead(uint8_t inode_index, uint8_t block_num)
+{
+	// Streams of other files may be added by other worker threads
+	Read_stream *stream;
+	{
+		std::lock_guard<std::mutex> lock(read_stream_mutex);
+		stream = &read_streams[inode_index];
+	}
+
+	if (block_num != stream->next_block)
+	{
+		// Random read resets read-ahead
+		stream->window = 0;
+		stream->ahead_block = 0;
+		stream->next_block = block_num + 1;
+		return;
+	}
+
+	// Double window for every sequential read
+	if (stream->window == 0)
+	{
+		stream->window = READ_AHEAD_MIN;
+	}
+	else if (stream->window < READ_AHEAD_MAX)
+	{
+		stream->window *= 2;
+	}
+	stream->next_block = block_num + 1;
+
+	uint8_t size = fs_file_size(inode_index);
+	uint8_t start = (stream->ahead_block > block_num + 1) ? stream->ahead_block : block_num + 1;
+	uint8_t end = (block_num + 1 + stream->window < size) ? block_num + 1 + stream->window : size;
+
+	// Prefetch each run of contiguous data blocks in window with one read
+	uint8_t run_start = 0;
+	uint8_t run_size = 0;
+	for (uint8_t i = start; i < end; i++)
+	{
+		uint8_t data_block = fs_file_block(inode_index, i);
+		if ((run_size > 0) && (data_block == run_start + run_size))
+		{
+			run_size++;
+			continue;
+		}
+
+		if (run_size > 0)
+		{
+			io_prefetch(run_start, run_size);
+		}
+		run_start = data_block;
+		run_size = (data_block != 0);
+	}
+
+	if (run_size > 0)
+	{
+		io_prefetch(run_start, run_size);
+	}
+
+	if (end > stream->ahead_block)
+	{
+		stream->ahead_block = end;
+	}
+}
+
+
+/**
+* @brief 	Read block of file into buffer
+* @param 	inode_index - index of file inode
+* @param	block_num - block number relative to start block of file
+* @param	data_block - data block that holds block, 0 if never written
+*/
+void fs_read_data(uint8_t inode_index, uint8_t block_num, uint8_t data_block)
+{
+	fs_read_ahead(inode_index, block_num);
+
+	if (data_block == 0)
+	{
+		// Block of sparse file that was never written reads as zeros
+		memset(data_buffer, 0, FS_BLOCK_SIZE);
+		return;
+	}
+
+	// Read block into buffer from cache or disk
+	if (io_read_block(data_block, data_buffer) < 0)
+	{
+		fprintf(fs_err, "Error: Checksum mismatch in block %d of %s\n", data_block, disk_name);
+	}
+}
+
+
+/**
+* @brief 	Write buffer to block of file
+* @param 	inode_index - index of file inode
+* @param	block_num - block number relative to start block of file
+* @param	data_block - data block that holds block, 0 if never written
+*/
+void fs_write_data(uint8_t inode_index, uint8_t block_num, uint8_t data_block)
+{
+	if (data_block == 0)
+	{
+		// Allocate block of sparse file on first write
+		data_block = fs_alloc_block(fs_sb.inode[inode_index].dir_parent & FS_MASK);
+		if (data_block == 0)
+		{
+			// No empty block left on disk
+			fprintf(fs_err, "Error: Cannot allocate %d on %s\n", 1, disk_name);
+			return;
+		}
+		file_maps[inode_index].block[block_num] = data_block;
+
+		Dir_usage usage = {1, 0, 0};
+		fs_usage_add(fs_sb.inode[inode_index].dir_parent & FS_MASK, usage, 1);
+
+		// Update free block list and block map on disk
+		fs_write_free_list();
+		fs_write_map(inode_index);
+	}
+	else if (fs_is_shared(data_block))
+	{
+		// Block merged by dedup is copied on write, whole block is written
+		data_block = fs_unshare_block(inode_index, block_num, 0);
+		if (data_block == 0)
+		{
+			// No empty block left on disk
+			fprintf(fs_err, "Error: Cannot allocate %d on %s\n", 1, disk_name);
+			return;
+		}
+
+		// Update free block list and block map on disk
+		fs_write_free_list();
+		fs_write_map(inode_index);
+	}
+
+	// Write buffer to block
+	io_write_block(data_block, data_buffer);
+}
+
+
+/**
+* @brief 	Read block from file
+* @param 	name - file to read from
+* @param	block_num - block number relative to start block of file
+*/
+void fs_read(char name[5], int block_num)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	int inode_index = fs_search_curr_dir(name);
+	if (inode_index < 0)
+	{
+		// Cannot find file with given name
+		fprintf(fs_err, "Error: File %s does not exist\n", name);
+		return;
+	}
+
+	Inode *inode = &fs_sb.inode[inode_index];
+	if (CHECK_FLAG(inode->dir_parent))
+	{
+		// Given name belongs to directory
+		fprintf(fs_err, "Error: File %s does not exist\n", name);
+		return;
+	}
+
+	if (block_num >= fs_file_size(inode_index))
+	{
+		// Block number is outside file blocks
+		fprintf(fs_err, "Error: %s does not have block %d\n", name, block_num);
+		return;
+	}
+
+	fs_read_data(inode_index, block_num, fs_file_block(inode_index, block_num));
+}
+
+
+/**
+* @brief 	Write block to file
+* @param 	name - file to write to
+* @param	block_num - block number relative to start block of file
+*/
+void fs_write(char name[5], int block_num)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	int inode_index = fs_search_curr_dir(name);
+	if (inode_index < 0)
+	{
+		// Cannot find file with given name
+		fprintf(fs_err, "Error: File %s does not exist\n", name);
+		return;
+	}
+
+	Inode *inode = &fs_sb.inode[inode_index];
+	if (CHECK_FLAG(inode->dir_parent))
+	{
+		// Given name belongs to directory
+		fprintf(fs_err, "Error: File %s does not exist\n", name);
+		return;
+	}
+
+	if (block_num >= fs_file_size(inode_index))
+	{
+		// Block number is outside file blocks
+		fprintf(fs_err, "Error: %s does not have block %d\n", name, block_num);
+		return;
+	}
+
+	fs_write_data(inode_index, block_num, fs_file_block(inode_index, block_num));
+}
+
+
+/**
+* @brief 	Flush and fill buffer with provided data
+* @param 	buff - provided data
+*/
+void fs_buff(uint8_t buff[FS_BLOCK_SIZE])
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	// Flush and copy data into buffer
+	memset(data_buffer, 0, FS_BLOCK_SIZE);
+	memcpy(data_buffer, buff, strlen((char *) buff));
+}
+
+
+/**
+* @brief 	Append files and directories in directory to output
+* @param 	sb - superblock
+* @param 	dirs - directory map
+* @param 	maps - block maps of mapped files
+* @param 	dir - index of directory inode
+* @param 	out - output buffer
+*/
+void fs_ls_format(const Super_block *sb, const std::map< uint8_t, std::set<uint8_t> > &dirs,
+	const std::map< uint8_t, Block_map > &maps, uint8_t dir, std::string &out)
+{
+	// Number of children of directory, including "." and ".."
+	auto num_of_children = [&dirs](uint8_t index) {
+		std::map< uint8_t, std::set<uint8_t> >::const_iterator it = dirs.find(index);
+		return (int) ((it != dirs.end()) ? it->second.size() : 0) + 2;
+	};
+
+	// Number of children in current directory
+	char line[80];
+	snprintf(line, sizeof(line), "%-5s %3d\n", ".", num_of_children(dir));
+	out += line;
+
+	// Number of children in parent directory
+	uint8_t parent = (dir != FS_ROOT) ? (sb->inode[dir].dir_parent & FS_MASK) : dir;
+	snprintf(line, sizeof(line), "%-5s %3d\n", "..", num_of_children(parent));
+	out += line;
+
+	std::map< uint8_t, std::set<uint8_t> >::const_iterator children = dirs.find(dir);
+	if (children == dirs.end())
+	{
+		return;
+	}
+
+	char name[FS_NAME_LEN + 1];
+	for (std::set<uint8_t>::const_iterator it = children->second.begin(); it != children->second.end(); it++)
+	{
+		const Inode *inode = &sb->inode[*it];
+
+		strncpy(name, inode->name, FS_NAME_LEN);
+		name[FS_NAME_LEN] = 0;
+
+		if (CHECK_FLAG(inode->dir_parent))
+		{
+			// Number of children in directory
+			snprintf(line, sizeof(line), "%-5s %3d\n", name, num_of_children(*it));
+		}
+		else if (fs_is_mapped(inode) && fs_map_sparse(&maps.find(*it)->second))
+		{
+			// Logical and allocated size of sparse file
+			const Block_map *map = &maps.find(*it)->second;
+			snprintf(line, sizeof(line), "%-5s %3d KB %3d KB\n", name, fs_map_size(map), fs_map_allocated(map));
+		}
+		else if (fs_is_mapped(inode))
+		{
+			// Size of file spread over free extents
+			snprintf(line, sizeof(line), "%-5s %3d KB\n", name, fs_map_size(&maps.find(*it)->second));
+		}
+		else
+		{
+			// Size of file
+			snprintf(line, sizeof(line), "%-5s %3d KB\n", name, inode->used_size & FS_MASK);
+		}
+		out += line;
+	}
+}
+
+
+/**
+* @brief 	Print files and directories in current directory
+*/
+void fs_ls(void)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	// Output is built in memory and printed with one write
+	std::string out;
+	fs_ls_format(&fs_sb, dir_map, file_maps, curr_dir, out);
+
+	fwrite(out.data(), 1, out.size(), fs_out);
+}
+
+
+/**
+* @brief 	Resize data blocks of file to new size
+* @param 	inode_index - index of file inode
+* @param 	new_size - new file size
+* @param 	name - file name used in error messages
+*/
+void fs_resize_blocks(uint8_t inode_index, int new_size, const char *name)
+{
+	Inode *inode = &fs_sb.inode[inode_index];
+
+	if (fs_is_mapped(inode))
+	{
+		Block_map *map = &file_maps[inode_index];
+		uint8_t size = fs_map_size(map);
+		if (new_size == size)
+		{
+			return;
+		}
+
+		if (new_size < size)
+		{
+			// Delete data from written blocks past new size
+			const uint8_t *empty_buff = io_zero_block();
+			for (uint8_t i = new_size; i < size; i++)
+			{
+				if (map->block[i] != 0)
+				{
+					fs_drop_block(map->block[i], empty_buff);
+					map->block[i] = 0;
+				}
+			}
+
+			// Update free block list on disk
+			fs_write_free_list();
+		}
+		else if (fs_map_sparse(map) == 0)
+		{
+			// Blocks past old size of a file that is not sparse are reserved
+			// at once, so writing them never runs out of space
+			uint8_t blocks[FS_BLOCK_COUNT];
+			if (fs_alloc_extents(new_size - size, blocks, inode->dir_parent & FS_MASK) == 0)
+			{
+				// Reject new size
+				fprintf(fs_err, "Error: File %s cannot expand to size %d\n", name, new_size);
+				return;
+			}
+
+			memcpy(&map->block[size], blocks, new_size - size);
+			fs_write_free_list();
+		}
+
+		// Blocks past old size of a sparse file are allocated when first written
+		map->size = (map->size & FS_FLAG) | new_size;
+		fs_write_map(inode_index);
+		return;
+	}
+
+	uint8_t size = inode->used_size & FS_MASK;
+	if (new_size > size)
+	{
+		uint8_t found_space = 0;
+
+		if ((inode->start_block + new_size) < FS_BLOCK_COUNT)
+		{
+			found_space = 1;
+			for (uint8_t i = inode->start_block + size; i < (inode->start_block + new_size); i++)
+			{
+				if (Fs_geometry::is_free(fs_sb.free_block_list, i) == 0)
+				{
+					found_space = 0;
+					break;
+				}
+			}
+
+			if (found_space)
+			{
+				// Found enough space after already allocated block
+				fs_set_free_blocks(inode->start_block + size, inode->start_block + new_size - 1, 1);
+				inode->used_size = FS_FLAG | new_size;
+
+				// Update superblock on disk
+				fs_write_free_list();
+				fs_write_inode(inode_index);
+
+				return;
+			}
+		}
+
+		// Save existing free block list and remove allocated blocks from list
+		char saved_free_block_list[FS_FREE_LIST_SIZE];
+		memcpy(saved_free_block_list, fs_sb.free_block_list, FS_FREE_LIST_SIZE);
+		fs_set_free_blocks(inode->start_block, inode->start_block + size - 1, 0);
+
+		// First run of empty blocks, which may overlap the file
+		uint8_t start_block_num = fs_find_run(new_size, inode->dir_parent & FS_MASK);
+		if (start_block_num != 0)
+		{
+			// Reserve blocks in free block list
+			fs_set_free_blocks(start_block_num, start_block_num + new_size - 1, 1);
+
+			// Move data
+			fs_move_blocks(inode->start_block, start_block_num, size);
+
+			// Update inode
+			inode->used_size = FS_FLAG | new_size;
+			inode->start_block = start_block_num;
+
+			// Update superblock on disk
+			fs_write_free_list();
+			fs_write_inode(inode_index);
+
+			return;
+		}
+
+		// Restore free block list
+		memcpy(fs_sb.free_block_list, saved_free_block_list, FS_FREE_LIST_SIZE);
+
+		// Keep existing blocks in place and add blocks from free extents
+		// with a block map
+		uint8_t blocks[FS_BLOCK_COUNT];
+		if (fs_alloc_extents(new_size - size + 1, blocks, inode->dir_parent & FS_MASK))
+		{
+			Block_map map;
+			memset(&map, 0, sizeof(Block_map));
+			map.size = new_size;
+			for (uint8_t i = 0; i < size; i++)
+			{
+				map.block[i] = inode->start_block + i;
+			}
+			memcpy(&map.block[size], &blocks[1], new_size - size);
+			file_maps[inode_index] = map;
+
+			// Update inode
+			inode->used_size = FS_FLAG;
+			inode->start_block = blocks[0];
+
+			// Update superblock and block map on disk
+			fs_write_free_list();
+			fs_write_inode(inode_index);
+			fs_write_map(inode_index);
+
+			return;
+		}
+
+		// Reject new size
+		fprintf(fs_err, "Error: File %s cannot expand to size %d\n", name, new_size);
+	}
+	else if (new_size < size)
+	{
+		// Delete data from blocks to deallocate
+		size_t size = inode->used_size & FS_MASK;
+		const uint8_t *empty_buff = io_zero_block();
+		for (uint8_t i = 0; i < (size - new_size); i++)
+		{
+			io_write_block(inode->start_block + new_size + i, empty_buff);
+		}
+
+		// Update superblock
+		fs_set_free_blocks(inode->start_block + new_size, inode->start_block + size - 1, 0);
+		inode->used_size = FS_FLAG | new_size;
+
+		// Update superblock on disk
+		fs_write_free_list();
+		fs_write_inode(inode_index);
+	}
+}
+
+
+/**
+* @brief 	Resize file to new size and update directory totals
+* @param 	inode_index - index of file inode
+* @param 	new_size - new file size
+* @param 	name - file name used in error messages
+*/
+void fs_resize_file(uint8_t inode_index, int new_size, const char *name)
+{
+	Dir_usage usage = fs_inode_usage(inode_index);
+	fs_resize_blocks(inode_index, new_size, name);
+
+	// Remove old blocks from totals and add new blocks
+	uint8_t parent = fs_sb.inode[inode_index].dir_parent & FS_MASK;
+	usage.blocks -= fs_inode_usage(inode_index).blocks;
+	usage.files = 0;
+	fs_usage_add(parent, usage, -1);
+}
+
+
+/**
+* @brief 	Resize file of provided name with new size
+* @param 	name - file name
+* @param 	new_size - new file size
+*/
+void fs_resize(char name[5], int new_size)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	int inode_index = fs_search_curr_dir(name);
+	if (inode_index < 0)
+	{
+		// Cannot find file with given name
+		fprintf(fs_err, "Error: File %s does not exist\n", name);
+		return;
+	}
+
+	Inode *inode = &fs_sb.inode[inode_index];
+	if (CHECK_FLAG(inode->dir_parent))
+	{
+		// Given name belongs to directory
+		fprintf(fs_err, "Error: File %s does not exist\n", name);
+		return;
+	}
+
+	fs_resize_file((uint8_t) inode_index, new_size, name);
+}
+
+
+/**
+* @brief 	Point block map entries of blocks with equal data to one shared
+* 			block and drop blocks holding only zeros, converting contiguous
+* 			files to mapped files where that frees blocks
+*/
+void fs_dedup_blocks(void)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint32_t free_before = Fs_geometry::count_free(fs_sb.free_block_list);
+
+	// Whole disk is read at once and compared in memory
+	std::vector<uint8_t> disk((size_t) FS_BLOCK_COUNT * FS_BLOCK_SIZE);
+	io_read(&disk[0], disk.size(), 0);
+
+	// Sort data blocks into classes of equal data, class 0 holds zero blocks
+	const uint8_t *empty_buff = io_zero_block();
+	int block_class[FS_BLOCK_COUNT];
+	std::multimap<uint32_t, uint8_t> fingerprints;
+	int class_count = 1;
+	for (int i = 0; i < FS_BLOCK_COUNT; i++)
+	{
+		block_class[i] = -1;
+	}
+	for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+	{
+		Inode *inode = &fs_sb.inode[i];
+		if ((CHECK_FLAG(inode->used_size) == 0) || CHECK_FLAG(inode->dir_parent))
+		{
+			continue;
+		}
+
+		for (uint8_t j = 0; j < fs_file_size(i); j++)
+		{
+			uint8_t block_num = fs_file_block(i, j);
+			if ((block_num == 0) || (block_class[block_num] >= 0))
+			{
+				continue;
+			}
+
+			const uint8_t *data = &disk[(size_t) block_num * FS_BLOCK_SIZE];
+			if (memcmp(data, empty_buff, FS_BLOCK_SIZE) == 0)
+			{
+				block_class[block_num] = 0;
+				continue;
+			}
+
+			// Blocks with equal fingerprints are compared byte by byte
+			uint32_t crc = crc32c(0, data, FS_BLOCK_SIZE);
+			std::multimap<uint32_t, uint8_t>::iterator it = fingerprints.lower_bound(crc);
+			for (; (it != fingerprints.end()) && (it->first == crc); it++)
+			{
+				if (memcmp(data, &disk[(size_t) it->second * FS_BLOCK_SIZE], FS_BLOCK_SIZE) == 0)
+				{
+					block_class[block_num] = block_class[it->second];
+					break;
+				}
+			}
+
+			if (block_class[block_num] < 0)
+			{
+				block_class[block_num] = class_count++;
+				fingerprints.insert(std::pair<uint32_t, uint8_t>(crc, block_num));
+			}
+		}
+	}
+
+	// Classes with a block in a block map, where other entries can point to it
+	std::vector<uint8_t> class_mapped(class_count, 0);
+	class_mapped[0] = 1;
+	for (std::map< uint8_t, Block_map >::iterator it = file_maps.begin(); it != file_maps.end(); it++)
+	{
+		for (uint8_t j = 0; j < fs_map_size(&it->second); j++)
+		{
+			if (it->second.block[j] != 0)
+			{
+				class_mapped[block_class[it->second.block[j]]] = 1;
+			}
+		}
+	}
+
+	// Contiguous file is given a block map if that frees more blocks than the
+	// block map takes, which may make it pay off for other files
+	uint8_t convert[FS_INODE_COUNT];
+	memset(convert, 0, sizeof(convert));
+	uint8_t changed = 1;
+	while (changed)
+	{
+		changed = 0;
+		for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+		{
+			Inode *inode = &fs_sb.inode[i];
+			if ((CHECK_FLAG(inode->used_size) == 0) || CHECK_FLAG(inode->dir_parent) || fs_is_mapped(inode) || convert[i])
+			{
+				continue;
+			}
+
+			std::map<int, int> counts;
+			for (uint8_t j = 0; j < (inode->used_size & FS_MASK); j++)
+			{
+				counts[block_class[inode->start_block + j]]++;
+			}
+
+			int saved = 0;
+			for (std::map<int, int>::iterator it = counts.begin(); it != counts.end(); it++)
+			{
+				saved += class_mapped[it->first] ? it->second : it->second - 1;
+			}
+
+			if (saved >= 2)
+			{
+				convert[i] = 1;
+				changed = 1;
+				for (std::map<int, int>::iterator it = counts.begin(); it != counts.end(); it++)
+				{
+					class_mapped[it->first] = 1;
+				}
+			}
+		}
+	}
+
+	// First block seen of each class is kept, mapped files before converted ones
+	std::vector<uint8_t> kept(class_count, 0);
+	int files_mapped = 0;
+	for (uint8_t pass = 0; pass < 2; pass++)
+	{
+		for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+		{
+			Inode *inode = &fs_sb.inode[i];
+			if ((CHECK_FLAG(inode->used_size) == 0) || CHECK_FLAG(inode->dir_parent) ||
+				((pass == 0) && (fs_is_mapped(inode) == 0)) || ((pass == 1) && (convert[i] == 0)))
+			{
+				continue;
+			}
+
+			uint8_t parent = inode->dir_parent & FS_MASK;
+			Dir_usage old_usage = fs_inode_usage(i);
+			uint8_t map_changed = 0;
+			if (pass == 1)
+			{
+				uint8_t map_block = fs_alloc_block(parent);
+				if (map_block == 0)
+				{
+					// File stays contiguous without a free block for its block map
+					continue;
+				}
+
+				Block_map map;
+				memset(&map, 0, sizeof(Block_map));
+				map.size = inode->used_size & FS_MASK;
+				for (uint8_t j = 0; j < map.size; j++)
+				{
+					map.block[j] = inode->start_block + j;
+				}
+				file_maps[i] = map;
+
+				inode->used_size = FS_FLAG;
+				inode->start_block = map_block;
+				files_mapped++;
+				map_changed = 1;
+			}
+
+			// Dropped blocks are only freed once the map no longer lists them
+			std::vector<uint8_t> dropped;
+			Block_map *map = &file_maps[i];
+			for (uint8_t j = 0; j < fs_map_size(map); j++)
+			{
+				uint8_t block_num = map->block[j];
+				if (block_num == 0)
+				{
+					continue;
+				}
+
+				int c = block_class[block_num];
+				if (c == 0)
+				{
+					// Zero block reads the same once it is never written
+					dropped.push_back(block_num);
+					map->block[j] = 0;
+					map_changed = 1;
+				}
+				else if (kept[c] == 0)
+				{
+					kept[c] = block_num;
+				}
+				else if (kept[c] != block_num)
+				{
+					fs_add_ref(kept[c]);
+					dropped.push_back(block_num);
+					map->block[j] = kept[c];
+					map_changed = 1;
+				}
+			}
+
+			if (map_changed)
+			{
+				fs_usage_add(parent, old_usage, -1);
+				fs_usage_add(parent, fs_inode_usage(i), 1);
+
+				// Update block map and inode on disk before dropped blocks are
+				// zeroed, so a crash never leaves the map listing a freed block
+				fs_write_map(i);
+				if (pass == 1)
+				{
+					fs_write_inode(i);
+				}
+			}
+
+			for (size_t j = 0; j < dropped.size(); j++)
+			{
+				fs_drop_block(dropped[j], empty_buff);
+			}
+		}
+	}
+
+	// Update free block list on disk
+	fs_write_free_list();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double mb = (double) disk.size() / (1 << 20);
+	fprintf(fs_out, "%d blocks reclaimed, %d shared blocks, %d files mapped, %.1f MB/s\n",
+		(int) (Fs_geometry::count_free(fs_sb.free_block_list) - free_before), (int) block_refs.size(), files_mapped,
+		(seconds > 0) ? mb / seconds : 0.0);
+}
+
+
+/**
+* @brief 	Defragment disk
+*/
+void fs_defrag(void)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	// Blocks of detached directories are not worth moving
+	fs_reclaim(RECLAIM_ALL);
+
+	if (dedup_mode)
+	{
+		// Blocks freed by dedup are packed away with the rest
+		fs_dedup_blocks();
+	}
+
+	std::priority_queue<Block_run, std::vector<Block_run>, custom_compare> runs;
+
+	// Arrange used data blocks in order they appear on disk
+	for (uint8_t i = 0; i < FS_INODE_COUNT; i++)
+	{
+		Inode *inode = &fs_sb.inode[i];
+		if (CHECK_FLAG(inode->used_size))
+		{
+			if (CHECK_FLAG(inode->dir_parent) == 0)
+			{
+				if (fs_is_mapped(inode))
+				{
+					// Block map and each written block of mapped file
+					Block_map *map = &file_maps[i];
+					Block_run map_run = {inode->start_block, 1, i, -1};
+					runs.push(map_run);
+					for (uint8_t j = 0; j < fs_map_size(map); j++)
+					{
+						if (map->block[j] != 0)
+						{
+							Block_run data_run = {map->block[j], 1, i, j};
+							runs.push(data_run);
+						}
+					}
+				}
+				else
+				{
+					Block_run file_run = {inode->start_block, (uint8_t) (inode->used_size & FS_MASK), i, -1};
+					runs.push(file_run);
+				}
+			}
+		}
+	}
+
+	// Set first available block to 1
+	uint8_t next_available_block = 1;
+	std::set<uint8_t> moved_maps;
+
+	// Where each block merged by dedup was moved, for the other entries
+	// pointing to it
+	uint8_t moved_to[FS_BLOCK_COUNT];
+	memset(moved_to, 0, sizeof(moved_to));
+
+	while(!runs.empty())
+	{
+		Block_run run = runs.top();
+		Inode *inode = &fs_sb.inode[run.inode_index];
+
+		if ((run.file_block >= 0) && (moved_to[run.start_block] != 0))
+		{
+			// Shared block was already placed for an earlier entry
+			if (moved_to[run.start_block] != run.start_block)
+			{
+				file_maps[run.inode_index].block[run.file_block] = moved_to[run.start_block];
+				moved_maps.insert(run.inode_index);
+			}
+			runs.pop();
+			continue;
+		}
+		uint8_t old_start = run.start_block;
+
+		// Check if run is occupying next "avaliable" block
+		if (next_available_block < run.start_block)
+		{
+			// Shift data
+			fs_move_blocks(run.start_block, next_available_block, run.size);
+
+			if (run.file_block >= 0)
+			{
+				// Block map is written once all blocks have moved
+				file_maps[run.inode_index].block[run.file_block] = next_available_block;
+				moved_maps.insert(run.inode_index);
+			}
+			else
+			{
+				// Update inode on disk
+				inode->start_block = next_available_block;
+				fs_write_inode(run.inode_index);
+
+				if (fs_is_mapped(inode))
+				{
+					moved_maps.insert(run.inode_index);
+				}
+			}
+
+			run.start_block = next_available_block;
+		}
+
+		if ((run.file_block >= 0) && fs_is_shared(old_start))
+		{
+			moved_to[old_start] = run.start_block;
+		}
+
+		// Update next "available" block
+		next_available_block = run.start_block + run.size;
+
+		runs.pop();
+	}
+
+	// Shared blocks now have their new numbers
+	fs_count_refs();
+
+	// Update block maps of mapped files on disk
+	for (std::set<uint8_t>::iterator it = moved_maps.begin(); it != moved_maps.end(); it++)
+	{
+		fs_write_map(*it);
+	}
+
+	// Update free block list on disk
+	fs_set_free_blocks(0, next_available_block - 1, 1);
+	if (next_available_block < FS_BLOCK_COUNT)
+	{
+		fs_set_free_blocks(next_available_block, FS_BLOCK_COUNT - 1, 0);
+	}
+	fs_write_free_list();
+
+	// Goals are taken again from where files now end
+	dir_goal.clear();
+}
+
+
+/**
+* @brief 	Change working directory
+* @param 	name - name of directory to change to
+*/
+void fs_cd(char name[5])
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	if (strcmp(name, ".") == 0)
+	{
+		// Already in current working directory
+		return;
+	}
+
+	if (strcmp(name, "..") == 0)
+	{
+		if (curr_dir != FS_ROOT)
+		{
+			// Change to parent directory
+			Inode *inode = &fs_sb.inode[curr_dir];
+			uint8_t parent = inode->dir_parent & FS_MASK;
+			curr_dir = parent;
+		}
+		return;
+	}
+
+	int inode_index = fs_search_curr_dir(name);
+	if (inode_index < 0)
+	{
+		// Cannot find directory with given name
+		fprintf(fs_err, "Error: Directory %s does not exist\n", name);
+		return;
+	}
+
+	Inode *inode = &fs_sb.inode[inode_index];
+	if (CHECK_FLAG(inode->dir_parent) == 0)
+	{
+		// Given name belongs to file
+		fprintf(fs_err, "Error: Directory %s does not exist\n", name);
+		return;
+	}
+
+	// Update current working directory
+	curr_dir = inode_index;
+}
+
+
+/**
+* @brief 	Move file or directory in current directory to another directory
+* 			or name without copying its data
+* @param 	name - file or directory to move
+* @param 	dest - directory to move into, or path with new name
+*/
+void fs_move(char name[5], char *dest)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	int inode_index = fs_search_curr_dir(name);
+	if (inode_index < 0)
+	{
+		// Cannot find file or directory with given name
+		fprintf(fs_err, "Error: File or directory %s does not exist\n", name);
+		return;
+	}
+	Inode *inode = &fs_sb.inode[inode_index];
+
+	int dest_dir = fs_resolve_path(dest);
+	char new_name[FS_NAME_LEN + 1];
+	strncpy(new_name, inode->name, FS_NAME_LEN);
+	new_name[FS_NAME_LEN] = 0;
+
+	if ((dest_dir >= 0) && (dest_dir != FS_ROOT) && (CHECK_FLAG(fs_sb.inode[dest_dir].dir_parent) == 0))
+	{
+		// Files are never replaced
+		fprintf(fs_err, "Error: File or directory %s already exists\n", dest);
+		return;
+	}
+
+	if (dest_dir < 0)
+	{
+		// Last component of path is new name in its parent directory
+		std::string path(dest);
+		size_t slash = path.rfind('/');
+		std::string last = (slash == std::string::npos) ? path : path.substr(slash + 1);
+		std::string parent_path = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+
+		dest_dir = fs_resolve_path(parent_path.c_str());
+		if ((dest_dir < 0) || ((dest_dir != FS_ROOT) && (CHECK_FLAG(fs_sb.inode[dest_dir].dir_parent) == 0)))
+		{
+			// Cannot find directory to move into
+			fprintf(fs_err, "Error: Directory %s does not exist\n", parent_path.c_str());
+			return;
+		}
+
+		if ((last.size() > FS_NAME_LEN) || last.empty() || (last == ".") || (last == ".."))
+		{
+			// Name cannot be used for file or directory
+			fprintf(fs_err, "Error: Invalid name %s\n", last.c_str());
+			return;
+		}
+		strcpy(new_name, last.c_str());
+	}
+
+	if (CHECK_FLAG(inode->dir_parent))
+	{
+		// Directory cannot move into itself or its own subtree
+		for (int dir = dest_dir; dir != FS_ROOT; dir = fs_sb.inode[dir].dir_parent & FS_MASK)
+		{
+			if (dir == inode_index)
+			{
+				fprintf(fs_err, "Error: Cannot move directory %s into itself\n", name);
+				return;
+			}
+		}
+	}
+
+	int existing = fs_search_dir(dest_dir, new_name);
+	if (existing == inode_index)
+	{
+		// Already has given name in given directory
+		return;
+	}
+	if (existing >= 0)
+	{
+		// Duplicate file name
+		fprintf(fs_err, "Error: File or directory %s already exists\n", new_name);
+		return;
+	}
+
+	// Move subtree totals from old parent to new parent
+	uint8_t parent = inode->dir_parent & FS_MASK;
+	Dir_usage usage = fs_inode_usage(inode_index);
+	if (CHECK_FLAG(inode->dir_parent))
+	{
+		usage.blocks += dir_usage[inode_index].blocks;
+		usage.files += dir_usage[inode_index].files;
+		usage.dirs += dir_usage[inode_index].dirs;
+	}
+	fs_usage_add(parent, usage, -1);
+
+	// Relink inode
+	dir_map[parent].erase(inode_index);
+	fs_index_remove(inode_index);
+	memset(inode->name, 0, FS_NAME_LEN);
+	strncpy(inode->name, new_name, FS_NAME_LEN);
+	inode->dir_parent = (inode->dir_parent & FS_FLAG) | dest_dir;
+	dir_map[dest_dir].insert(inode_index);
+	fs_index_add(inode_index);
+
+	fs_usage_add(dest_dir, usage, 1);
+
+	// Update inode on disk
+	fs_write_inode(inode_index);
+}
+
+
+/**
+* @brief 	Commit, discard or save changes of disk mounted as overlay
+* @param 	action - "commit", "discard" or "save"
+* @param 	delta_name - file to save delta to
+*/
+void fs_overlay(char *action, char *delta_name)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	if (fs_dev->overlay == 0)
+	{
+		// Changes were already written to disk
+		fprintf(fs_err, "Error: Disk %s is not mounted as an overlay\n", disk_name);
+		return;
+	}
+
+	if (strcmp(action, "commit") == 0)
+	{
+		if (io_commit() < 0)
+		{
+			fprintf(fs_err, "Error: Cannot commit changes to %s\n", disk_name);
+		}
+	}
+	else if (strcmp(action, "discard") == 0)
+	{
+		// Mounting disk again as an overlay drops every change made since
+		// it was mounted, on top of the delta it was mounted with
+		char name[50];
+		strcpy(name, disk_name);
+		std::string delta = delta_path;
+		uint8_t saved_overlay_mode = overlay_mode;
+		overlay_mode = 1;
+		fs_mount(name, delta.empty() ? NULL : (char *) delta.c_str());
+		overlay_mode = saved_overlay_mode;
+	}
+	else if (io_save_delta(delta_name) < 0)
+	{
+		fprintf(fs_err, "Error: Cannot save changes to %s\n", delta_name);
+	}
+}
+
+
+/**
+* @brief 	Print totals of current directory subtree
+*/
+void fs_du(void)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	Dir_usage *usage = &dir_usage[curr_dir];
+	fprintf(fs_out, "%-5s %3d KB %3d files %3d directories\n", ".", usage->blocks, usage->files, usage->dirs);
+}
+
+
+/**
+* @brief 	Append tree of directory to output
+* @param 	dir - index of directory inode
+* @param 	depth - depth of directory below first directory
+* @param 	out - output buffer
+*/
+void fs_tree_r(uint8_t dir, int depth, std::string &out)
+{
+	char line[80];
+
+	for (std::set<uint8_t>::iterator it = dir_map[dir].begin(); it != dir_map[dir].end(); it++)
+	{
+		Inode *inode = &fs_sb.inode[*it];
+
+		char name[FS_NAME_LEN + 1];
+		strncpy(name, inode->name, FS_NAME_LEN);
+		name[FS_NAME_LEN] = 0;
+
+		if (CHECK_FLAG(inode->dir_parent))
+		{
+			Dir_usage *usage = &dir_usage[*it];
+			snprintf(line, sizeof(line), "%*s%-5s %3d KB %3d files %3d directories\n", depth * 2, "", name, usage->blocks, usage->files, usage->dirs);
+			out += line;
+			fs_tree_r(*it, depth + 1, out);
+		}
+		else
+		{
+			snprintf(line, sizeof(line), "%*s%-5s %3d KB\n", depth * 2, "", name, fs_inode_usage(*it).blocks);
+			out += line;
+		}
+	}
+}
+
+
+/**
+* @brief 	Print tree of current directory with totals of each directory
+*/
+void fs_tree(void)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	// Output is built in memory and printed with one write
+	std::string out;
+	char line[80];
+
+	Dir_usage *usage = &dir_usage[curr_dir];
+	snprintf(line, sizeof(line), "%-5s %3d KB %3d files %3d directories\n", ".", usage->blocks, usage->files, usage->dirs);
+	out += line;
+	fs_tree_r(curr_dir, 1, out);
+
+	fwrite(out.data(), 1, out.size(), fs_out);
+}
+
+
+/**
+* @brief 	Append seek distances of reading every file of directory in turn,
+* 			and of each directory below it, to output
+* @param 	dir - index of directory inode
+* @param 	name - name of directory printed in output
+* @param 	depth - depth of directory below first directory
+* @param 	out - output buffer
+*/
+void fs_locality_r(uint8_t dir, const char *name, int depth, std::string &out)
+{
+	// Files are read in the order fs_delete_r visits them
+	int blocks = 0;
+	int seek = 0;
+	int prev_block = -1;
+	for (std::set<uint8_t>::iterator it = dir_map[dir].begin(); it != dir_map[dir].end(); it++)
+	{
+		if (CHECK_FLAG(fs_sb.inode[*it].dir_parent))
+		{
+			continue;
+		}
+
+		for (uint8_t i = 0; i < fs_file_size(*it); i++)
+		{
+			int block_num = fs_file_block(*it, i);
+			if (block_num == 0)
+			{
+				continue;
+			}
+
+			if (prev_block >= 0)
+			{
+				// Distance from the block after the previous one
+				seek += abs(block_num - (prev_block + 1));
+			}
+			prev_block = block_num;
+			blocks++;
+		}
+	}
+
+	char line[80];
+	snprintf(line, sizeof(line), "%*s%-5s %3d blocks %6.2f average seek\n", depth * 2, "", name, blocks,
+		(blocks > 1) ? (double) seek / (blocks - 1) : 0.0);
+	out += line;
+
+	for (std::set<uint8_t>::iterator it = dir_map[dir].begin(); it != dir_map[dir].end(); it++)
+	{
+		Inode *inode = &fs_sb.inode[*it];
+		if (CHECK_FLAG(inode->dir_parent))
+		{
+			char child_name[FS_NAME_LEN + 1];
+			strncpy(child_name, inode->name, FS_NAME_LEN);
+			child_name[FS_NAME_LEN] = 0;
+			fs_locality_r(*it, child_name, depth + 1, out);
+		}
+	}
+}
+
+
+/**
+* @brief 	Print average seek distance, in blocks, between consecutive blocks
+* 			of the files of current directory and of each directory below it
+*/
+void fs_locality(void)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	// Output is built in memory and printed with one write
+	std::string out;
+	fs_locality_r(curr_dir, ".", 0, out);
+
+	fwrite(out.data(), 1, out.size(), fs_out);
+}
+
+
+/**
+* @brief 	Append full path of every file and directory with given name, or
+* 			with given prefix if pattern ends with '*', to output
+* @param 	sb - superblock
+* @param 	index - name index
+* @param 	pattern - name or prefix followed by '*'
+* @param 	out - output buffer
+*/
+void fs_find_format(const Super_block *sb, const std::map< std::string, std::set<uint8_t> > &index,
+	const char *pattern, std::string &out)
+{
+	std::string name(pattern);
+	uint8_t prefix = (!name.empty()) && (name[name.size() - 1] == '*');
+	if (prefix)
+	{
+		name.erase(name.size() - 1);
+	}
+
+	std::map< std::string, std::set<uint8_t> >::const_iterator it = prefix ? index.lower_bound(name) : index.find(name);
+	for (; (it != index.end()) && (it->first.compare(0, name.size(), name) == 0); it++)
+	{
+		for (std::set<uint8_t>::const_iterator inode_it = it->second.begin(); inode_it != it->second.end(); inode_it++)
+		{
+			// Path is built from the inode up to root directory
+			std::string path;
+			for (int i = *inode_it; i != FS_ROOT; i = sb->inode[i].dir_parent & FS_MASK)
+			{
+				path.insert(0, "/" + std::string(sb->inode[i].name, strnlen(sb->inode[i].name, FS_NAME_LEN)));
+			}
+			if (CHECK_FLAG(sb->inode[*inode_it].dir_parent))
+			{
+				path += "/";
+			}
+			out += path + "\n";
+		}
+
+		if (!prefix)
+		{
+			break;
+		}
+	}
+}
+
+
+/**
+* @brief 	Print full path of every file and directory with given name, or
+* 			with given prefix if pattern ends with '*'
+* @param 	pattern - name or prefix followed by '*'
+*/
+void fs_find(char *pattern)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	// Output is built in memory and printed with one write
+	std::string out;
+	fs_find_format(&fs_sb, name_index, pattern, out);
+
+	if (out.empty())
+	{
+		fprintf(fs_err, "Error: File or directory %s does not exist\n", pattern);
+		return;
+	}
+
+	fwrite(out.data(), 1, out.size(), fs_out);
+}
+
+
+/**
+* @brief 	Find file in current directory that holds byte range starting at
+* 			file block
+* @param 	name - file name
+* @param 	block_num - first file block of range
+* @param 	length - number of bytes in range
+* @return 	-1 if not found or range is outside file, otherwise inode index
+*/
+int fs_search_range(char name[5], int block_num, size_t length)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return -1;
+	}
+
+	int inode_index = fs_search_curr_dir(name);
+	if ((inode_index < 0) || CHECK_FLAG(fs_sb.inode[inode_index].dir_parent))
+	{
+		// Cannot find file with given name
+		fprintf(fs_err, "Error: File %s does not exist\n", name);
+		return -1;
+	}
+
+	size_t end_block = block_num + ((length + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+	if (end_block > fs_file_size(inode_index))
+	{
+		// Range ends past last file block
+		fprintf(fs_err, "Error: %s does not have block %d\n", name, (int) end_block - 1);
+		return -1;
+	}
+
+	return inode_index;
+}
+
+
+/**
+* @brief 	Copy byte range of host file into blocks of file, without going
+* 			through the data buffer
+* @param 	host_path - host file to copy from
+* @param 	offset - offset in host file
+* @param 	length - number of bytes to copy
+* @param 	name - file to copy into
+* @param 	block_num - first file block to copy into
+*/
+void fs_import(char *host_path, off_t offset, size_t length, char name[5], int block_num)
+{
+	int inode_index = fs_search_range(name, block_num, length);
+	if (inode_index < 0)
+	{
+		return;
+	}
+
+	int host_fd = open(host_path, O_RDONLY);
+	struct stat st;
+	if ((host_fd < 0) || (fstat(host_fd, &st) < 0) || (offset + (off_t) length > st.st_size))
+	{
+		// Host file is missing or shorter than range
+		if (host_fd >= 0)
+		{
+			close(host_fd);
+		}
+		fprintf(fs_err, "Error: Cannot read %zu bytes at %lld of %s\n", length, (long long) offset, host_path);
+		return;
+	}
+
+	int end_block = block_num + ((length + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+	if (fs_is_mapped(&fs_sb.inode[inode_index]))
+	{
+		// Allocate every unwritten block of range before copying
+		Block_map *map = &file_maps[inode_index];
+		uint8_t allocated = 0;
+		uint8_t unshared = 0;
+		for (int i = block_num; i < end_block; i++)
+		{
+			if ((map->block[i] != 0) && fs_is_shared(map->block[i]))
+			{
+				// Range may end inside block, so block merged by dedup keeps its data
+				if (fs_unshare_block(inode_index, i, 1) == 0)
+				{
+					// No empty block left on disk
+					fprintf(fs_err, "Error: Cannot allocate %d on %s\n", end_block - i, disk_name);
+					end_block = i;
+					break;
+				}
+				unshared = 1;
+			}
+			else if (map->block[i] == 0)
+			{
+				map->block[i] = fs_alloc_block(fs_sb.inode[inode_index].dir_parent & FS_MASK);
+				if (map->block[i] == 0)
+				{
+					// No empty block left on disk
+					fprintf(fs_err, "Error: Cannot allocate %d on %s\n", end_block - i, disk_name);
+					end_block = i;
+					break;
+				}
+				allocated++;
+			}
+		}
+
+		if ((allocated > 0) || unshared)
+		{
+			Dir_usage usage = {allocated, 0, 0};
+			fs_usage_add(fs_sb.inode[inode_index].dir_parent & FS_MASK, usage, 1);
+
+			// Update free block list and block map on disk
+			fs_write_free_list();
+			fs_write_map(inode_index);
+		}
+	}
+
+	// Each run of contiguous data blocks is copied at once
+	int run_start = block_num;
+	while (run_start < end_block)
+	{
+		uint8_t data_block = fs_file_block(inode_index, run_start);
+		int run_end = run_start + 1;
+		while ((run_end < end_block) && (fs_file_block(inode_index, run_end) == data_block + (run_end - run_start)))
+		{
+			run_end++;
+		}
+
+		size_t run_offset = (size_t) (run_start - block_num) * FS_BLOCK_SIZE;
+		size_t run_length = (size_t) (run_end - run_start) * FS_BLOCK_SIZE;
+		if (run_offset + run_length > length)
+		{
+			run_length = length - run_offset;
+		}
+
+		if (io_import(host_fd, offset + run_offset, run_length, (off_t) data_block * FS_BLOCK_SIZE) != (ssize_t) run_length)
+		{
+			fprintf(fs_err, "Error: Cannot copy %s into %s\n", host_path, name);
+			break;
+		}
+		run_start = run_end;
+	}
+
+	close(host_fd);
+}
+
+
+/**
+* @brief 	Copy byte range starting at block of file into host file, without
+* 			going through the data buffer
+* @param 	name - file to copy from
+* @param 	block_num - first file block to copy from
+* @param 	length - number of bytes to copy
+* @param 	host_path - host file to copy into, created if missing
+* @param 	offset - offset in host file
+*/
+void fs_export(char name[5], int block_num, size_t length, char *host_path, off_t offset)
+{
+	int inode_index = fs_search_range(name, block_num, length);
+	if (inode_index < 0)
+	{
+		return;
+	}
+
+	int host_fd = open(host_path, O_WRONLY | O_CREAT, 0644);
+	if (host_fd < 0)
+	{
+		fprintf(fs_err, "Error: Cannot create %s\n", host_path);
+		return;
+	}
+
+	int end_block = block_num + ((length + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+	int run_start = block_num;
+	while (run_start < end_block)
+	{
+		uint8_t data_block = fs_file_block(inode_index, run_start);
+		int run_end = run_start + 1;
+		while ((run_end < end_block) && (fs_file_block(inode_index, run_end) == ((data_block == 0) ? 0 : data_block + (run_end - run_start))))
+		{
+			run_end++;
+		}
+
+		size_t run_offset = (size_t) (run_start - block_num) * FS_BLOCK_SIZE;
+		size_t run_length = (size_t) (run_end - run_start) * FS_BLOCK_SIZE;
+		if (run_offset + run_length > length)
+		{
+			run_length = length - run_offset;
+		}
+
+		ssize_t copied = 0;
+		if (data_block == 0)
+		{
+			// Blocks of sparse file that were never written read as zeros
+			std::vector<uint8_t> zeros(run_length, 0);
+			copied = pwrite(host_fd, &zeros[0], run_length, offset + run_offset);
+		}
+		else
+		{
+			copied = io_export(host_fd, offset + run_offset, run_length, (off_t) data_block * FS_BLOCK_SIZE);
+		}
+
+		if (copied != (ssize_t) run_length)
+		{
+			fprintf(fs_err, "Error: Cannot copy %s into %s\n", name, host_path);
+			break;
+		}
+		run_start = run_end;
+	}
+
+	close(host_fd);
+}
+
+
+/**
+* @brief 	Get open handle
+* @param 	handle - handle number
+* @return 	NULL if handle is not open, otherwise handle
+*/
+File_handle *fs_get_handle(int handle)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return NULL;
+	}
+
+	if (handles[handle].open == 0)
+	{
+		// Handle was never opened, was closed or its file was deleted
+		fprintf(fs_err, "Error: Handle %d is not open\n", handle);
+		return NULL;
+	}
+
+	return &handles[handle];
+}
+
+
+/**
+* @brief 	Verify every allocated block of mounted disk against its checksum
+* @param 	threads - number of threads, 0 for one per processor
+*/
+void fs_scrub(int threads)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	if (checksum_mode == 0)
+	{
+		fprintf(fs_err, "Error: Checksums are not enabled\n");
+		return;
+	}
+
+	if (threads == 0)
+	{
+		threads = std::thread::hardware_concurrency();
+		threads = ((threads < 1) || (threads > IO_SCRUB_THREADS)) ? IO_SCRUB_THREADS : threads;
+	}
+
+	std::vector<uint8_t> blocks;
+	for (int i = 0; i < FS_BLOCK_COUNT; i++)
+	{
+		if (Fs_geometry::is_free(fs_sb.free_block_list, i) == 0)
+		{
+			blocks.push_back(i);
+		}
+	}
+
+	Io_scrub result;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	io_scrub(blocks, threads, &result);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (size_t i = 0; i < result.corrupt.size(); i++)
+	{
+		fprintf(fs_err, "Error: Checksum mismatch in block %d of %s\n", result.corrupt[i], disk_name);
+	}
+
+	double mb = (double) blocks.size() * FS_BLOCK_SIZE / (1 << 20);
+	fprintf(fs_out, "%d blocks verified, %d checksums taken, %d corrupt, %.1f MB/s\n", result.verified, result.recorded,
+		(int) result.corrupt.size(), (seconds > 0) ? mb / seconds : 0.0);
+}
+
+
+/**
+* @brief 	Merge data blocks of files that hold equal data
+*/
+void fs_dedup(void)
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	fs_reclaim(RECLAIM_ALL);
+	fs_dedup_blocks();
+}
+
+
+/**
+* @brief 	Open file in current directory and print its handle
+* @param 	name - file to open
+*/
+void fs_open(char name[5])
+{
+	if (fs_fd < 0)
+	{
+		// No file system mounted
+		fprintf(fs_err, "Error: No file system is mounted\n");
+		return;
+	}
+
+	int inode_index = fs_search_curr_dir(name);
+	if ((inode_index < 0) || CHECK_FLAG(fs_sb.inode[inode_index].dir_parent))
+	{
+		// Cannot find file with given name
+		fprintf(fs_err, "Error: File %s does not exist\n", name);
+		return;
+	}
+
+	for (uint8_t i = 0; i < MAX_HANDLES; i++)
+	{
+		if (handles[i].open == 0)
+		{
+			// Bind lowest free handle to inode
+			handles[i].open = 1;
+			handles[i].inode_index = inode_index;
+			fs_refresh_handles(inode_index);
+
+			fprintf(fs_out, "%d\n", i);
+			return;
+		}
+	}
+
+	// No free handle
+	fprintf(fs_err, "Error: Cannot open %s, too many open files\n", name);
+}
+
+
+/**
+* @brief 	Close handle
+* @param 	handle - handle number
+*/
+void fs_close(int handle)
+{
+	File_handle *fh = fs_get_handle(handle);
+	if (fh != NULL)
+	{
+		fh->open = 0;
+	}
+}
+
+
+/**
+* @brief 	Read block from file of open handle
+* @param 	handle - handle number
+* @param	block_num - block number relative to start block of file
+*/
+void fs_hread(int handle, int block_num)
+{
+	File_handle *fh = fs_get_handle(handle);
+	if (fh == NULL)
+	{
+		return;
+	}
+
+	if (block_num >= fh->size)
+	{
+		// Block number is outside file blocks
+		fprintf(fs_err, "Error: Handle %d does not have block %d\n", handle, block_num);
 		return;
 	}
 
-	uint8_t size = inode->used_size & 0x7F;
-	if (new_size > size)
+	uint8_t data_block = fh->mapped ? file_maps[fh->inode_index].block[block_num] : fh->start_block + block_num;
+	fs_read_data(fh->inode_index, block_num, data_block);
+}
+
+
+/**
+* @brief 	Write block to file of open handle
+* @param 	handle - handle number
+* @param	block_num - block number relative to start block of file
+*/
+void fs_hwrite(int handle, int block_num)
+{
+	File_handle *fh = fs_get_handle(handle);
+	if (fh == NULL)
 	{
-		uint8_t found_space = 0;
+		return;
+	}
+
+	if (block_num >= fh->size)
+	{
+		// Block number is outside file blocks
+		fprintf(fs_err, "Error: Handle %d does not have block %d\n", handle, block_num);
+		return;
+	}
+
+	uint8_t data_block = fh->mapped ? file_maps[fh->inode_index].block[block_num] : fh->start_block + block_num;
+	fs_write_data(fh->inode_index, block_num, data_block);
+}
+
+
+/**
+* @brief 	Resize file of open handle
+* @param 	handle - handle number
+* @param 	new_size - new file size
+*/
+void fs_hresize(int handle, int new_size)
+{
+	File_handle *fh = fs_get_handle(handle);
+	if (fh == NULL)
+	{
+		return;
+	}
+
+	char name[FS_NAME_LEN + 1];
+	strncpy(name, fs_sb.inode[fh->inode_index].name, FS_NAME_LEN);
+	name[FS_NAME_LEN] = 0;
+
+	fs_resize_file(fh->inode_index, new_size, name);
+}
+
+
+/**
+* @brief 	Decode command line and check its arguments
+* @param 	command - command holding line to decode in str
+*/
+void fs_parse(Command *command)
+{
+	char **cmd_args = command->args;
+	memset(cmd_args, 0, sizeof(command->args));
+	command->type = CMD_INVALID;
+
+	uint8_t cmd_args_num = fs_tokenize(command->str, cmd_args);
+	char *cmd = cmd_args[0];
+	if (cmd == NULL)
+	{
+		// Line only holds whitespace
+		return;
+	}
 
-		if ((inode->start_block + new_size) < 128)
+	if (strcmp(cmd, "M") == 0)
+	{
+		if ((cmd_args_num == 2) || (cmd_args_num == 3))
 		{
-			found_space = 1;
-			for (uint8_t i = inode->start_block + size; i < (inode->start_block + new_size); i++)
+			command->type = CMD_MOUNT;
+		}
+	}
+	else if (strcmp(cmd, "C") == 0)
+	{
+		if (cmd_args_num == 3)
+		{
+			command->num = atoi(cmd_args[2]);
+			if ((strlen(cmd_args[1]) <= FS_NAME_LEN) && (command->num >= 0) && (command->num <= FS_MAX_FILE_BLOCKS))
+			{
+				command->type = CMD_CREATE;
+			}
+		}
+	}
+	else if (strcmp(cmd, "D") == 0)
+	{
+		if ((cmd_args_num == 2) && (strlen(cmd_args[1]) <= FS_NAME_LEN))
+		{
+			command->type = CMD_DELETE;
+		}
+	}
+	else if ((strcmp(cmd, "R") == 0) || (strcmp(cmd, "W") == 0))
+	{
+		if (cmd_args_num == 3)
+		{
+			command->num = atoi(cmd_args[2]);
+			if ((strlen(cmd_args[1]) <= FS_NAME_LEN) && (command->num >= 0) && (command->num < FS_MAX_FILE_BLOCKS))
+			{
+				command->type = (cmd[0] == 'R') ? CMD_READ : CMD_WRITE;
+			}
+		}
+	}
+	else if (strcmp(cmd, "B") == 0)
+	{
+		if ((cmd_args_num == 2) && (strlen(cmd_args[1]) <= FS_BLOCK_SIZE))
+		{
+			command->type = CMD_BUFF;
+		}
+	}
+	else if (strcmp(cmd, "L") == 0)
+	{
+		if (cmd_args_num == 1)
+		{
+			command->type = CMD_LS;
+		}
+	}
+	else if (strcmp(cmd, "E") == 0)
+	{
+		if (cmd_args_num == 3)
+		{
+			command->num = atoi(cmd_args[2]);
+			if ((strlen(cmd_args[1]) <= FS_NAME_LEN) && (command->num > 0) && (command->num <= FS_MAX_FILE_BLOCKS))
+			{
+				command->type = CMD_RESIZE;
+			}
+		}
+	}
+	else if (strcmp(cmd, "O") == 0)
+	{
+		if (cmd_args_num == 1)
+		{
+			command->type = CMD_DEFRAG;
+		}
+	}
+	else if (strcmp(cmd, "Y") == 0)
+	{
+		if ((cmd_args_num == 2) && (strlen(cmd_args[1]) <= FS_NAME_LEN))
+		{
+			command->type = CMD_CD;
+		}
+	}
+	else if (strcmp(cmd, "overlay") == 0)
+	{
+		char *action = cmd_args[1];
+		if (((cmd_args_num == 2) && ((strcmp(action, "commit") == 0) || (strcmp(action, "discard") == 0))) ||
+			((cmd_args_num == 3) && (strcmp(action, "save") == 0)))
+		{
+			command->type = CMD_OVERLAY;
+		}
+	}
+	else if (strcmp(cmd, "mv") == 0)
+	{
+		if ((cmd_args_num == 3) && (strlen(cmd_args[1]) <= FS_NAME_LEN))
+		{
+			command->type = CMD_MOVE;
+		}
+	}
+	else if ((strcmp(cmd, "du") == 0) || (strcmp(cmd, "tree") == 0))
+	{
+		if (cmd_args_num == 1)
+		{
+			command->type = (cmd[0] == 'd') ? CMD_DU : CMD_TREE;
+		}
+	}
+	else if (strcmp(cmd, "find") == 0)
+	{
+		size_t len = (cmd_args_num == 2) ? strlen(cmd_args[1]) : 0;
+		if ((len > 0) && ((len <= FS_NAME_LEN) || ((len == FS_NAME_LEN + 1) && (cmd_args[1][FS_NAME_LEN] == '*'))))
+		{
+			command->type = CMD_FIND;
+		}
+	}
+	else if ((strcmp(cmd, "import") == 0) || (strcmp(cmd, "export") == 0))
+	{
+		if (cmd_args_num == 6)
+		{
+			// import <host file> <offset> <length> <file> <block>
+			// export <file> <block> <length> <host file> <offset>
+			uint8_t import = (cmd[0] == 'i');
+			char *name = cmd_args[import ? 4 : 1];
+			command->num = atoi(cmd_args[import ? 5 : 2]);
+			command->offset = atoll(cmd_args[import ? 2 : 5]);
+			command->length = atoll(cmd_args[3]);
+			if ((strlen(name) <= FS_NAME_LEN) && (command->num >= 0) && (command->num < FS_MAX_FILE_BLOCKS) &&
+				(command->offset >= 0) && (atoll(cmd_args[3]) > 0))
+			{
+				command->type = import ? CMD_IMPORT : CMD_EXPORT;
+			}
+		}
+	}
+	else if (strcmp(cmd, "locality") == 0)
+	{
+		if (cmd_args_num == 1)
+		{
+			command->type = CMD_LOCALITY;
+		}
+	}
+	else if (strcmp(cmd, "scrub") == 0)
+	{
+		// scrub [threads]
+		command->num = (cmd_args_num == 2) ? atoi(cmd_args[1]) : 0;
+		if ((cmd_args_num <= 2) && (command->num >= 0) && (command->num <= IO_SCRUB_THREADS) &&
+			((cmd_args_num == 1) || (command->num > 0)))
+		{
+			command->type = CMD_SCRUB;
+		}
+	}
+	else if (strcmp(cmd, "dedup") == 0)
+	{
+		if (cmd_args_num == 1)
+		{
+			command->type = CMD_DEDUP;
+		}
+	}
+	else if (strcmp(cmd, "open") == 0)
+	{
+		if ((cmd_args_num == 2) && (strlen(cmd_args[1]) <= FS_NAME_LEN))
+		{
+			command->type = CMD_OPEN;
+		}
+	}
+	else if (strcmp(cmd, "close") == 0)
+	{
+		if (cmd_args_num == 2)
+		{
+			command->handle = atoi(cmd_args[1]);
+			if ((command->handle >= 0) && (command->handle < MAX_HANDLES))
+			{
+				command->type = CMD_CLOSE;
+			}
+		}
+	}
+	else if ((strcmp(cmd, "hread") == 0) || (strcmp(cmd, "hwrite") == 0))
+	{
+		if (cmd_args_num == 3)
+		{
+			command->handle = atoi(cmd_args[1]);
+			command->num = atoi(cmd_args[2]);
+			if ((command->handle >= 0) && (command->handle < MAX_HANDLES) && (command->num >= 0) && (command->num < FS_MAX_FILE_BLOCKS))
+			{
+				command->type = (cmd[1] == 'r') ? CMD_HREAD : CMD_HWRITE;
+			}
+		}
+	}
+	else if (strcmp(cmd, "hresize") == 0)
+	{
+		if (cmd_args_num == 3)
+		{
+			command->handle = atoi(cmd_args[1]);
+			command->num = atoi(cmd_args[2]);
+			if ((command->handle >= 0) && (command->handle < MAX_HANDLES) && (command->num > 0) && (command->num <= FS_MAX_FILE_BLOCKS))
 			{
-				uint8_t list_index = i / 8;
-				uint8_t bit_index = 7 - (i % 8);
-				char fb_byte = fs_sb.free_block_list[list_index];
+				command->type = CMD_HRESIZE;
+			}
+		}
+	}
+}
+
+
+/**
+* @brief 	Execute decoded command
+* @param 	command - decoded command
+* @param 	file_name - input file name used in error messages
+*/
+void fs_execute(Command *command, char *file_name)
+{
+	char **cmd_args = command->args;
+	io_set_command(cmd_args[0] ? cmd_args[0] : "", command->line_num);
+
+	switch (command->type)
+	{
+		case CMD_MOUNT:
+			fs_mount(cmd_args[1], cmd_args[2]);
+			break;
+		case CMD_CREATE:
+			fs_create(cmd_args[1], command->num);
+			break;
+		case CMD_DELETE:
+			fs_delete(cmd_args[1]);
+			break;
+		case CMD_READ:
+			fs_read(cmd_args[1], command->num);
+			break;
+		case CMD_WRITE:
+			fs_write(cmd_args[1], command->num);
+			break;
+		case CMD_BUFF:
+			fs_buff((uint8_t *) cmd_args[1]);
+			break;
+		case CMD_LS:
+			fs_ls();
+			break;
+		case CMD_RESIZE:
+			fs_resize(cmd_args[1], command->num);
+			break;
+		case CMD_DEFRAG:
+			fs_defrag();
+			break;
+		case CMD_CD:
+			fs_cd(cmd_args[1]);
+			break;
+		case CMD_OVERLAY:
+			fs_overlay(cmd_args[1], cmd_args[2]);
+			break;
+		case CMD_MOVE:
+			fs_move(cmd_args[1], cmd_args[2]);
+			break;
+		case CMD_DU:
+			fs_du();
+			break;
+		case CMD_TREE:
+			fs_tree();
+			break;
+		case CMD_FIND:
+			fs_find(cmd_args[1]);
+			break;
+		case CMD_IMPORT:
+			fs_import(cmd_args[1], command->offset, command->length, cmd_args[4], command->num);
+			break;
+		case CMD_EXPORT:
+			fs_export(cmd_args[1], command->num, command->length, cmd_args[4], command->offset);
+			break;
+		case CMD_LOCALITY:
+			fs_locality();
+			break;
+		case CMD_SCRUB:
+			fs_scrub(command->num);
+			break;
+		case CMD_DEDUP:
+			fs_dedup();
+			break;
+		case CMD_OPEN:
+			fs_open(cmd_args[1]);
+			break;
+		case CMD_CLOSE:
+			fs_close(command->handle);
+			break;
+		case CMD_HREAD:
+			fs_hread(command->handle, command->num);
+			break;
+		case CMD_HWRITE:
+			fs_hwrite(command->handle, command->num);
+			break;
+		case CMD_HRESIZE:
+			fs_hresize(command->handle, command->num);
+			break;
+		default:
+			// Invalid command
+			fprintf(fs_err, "Command Error: %s, %d\n", file_name, command->line_num);
+			break;
+	}
+}
+
+
+/**
+* @brief 	Read and decode commands from input file into command queue,
+* 			ending with CMD_END
+* @param 	fp - input file
+*/
+void fs_parse_input(FILE *fp)
+{
+	int line_num = 1;
+
+	while (1)
+	{
+		Command *command = command_queue.write_slot();
+		if (fgets(command->str, CMD_MAX_SIZE, fp) == NULL)
+		{
+			break;
+		}
 
-				if (CHECK_BIT(fb_byte, bit_index))
+		// Strip newline character or continue if empty command
+		size_t cmd_len = strlen(command->str);
+		if (cmd_len > 0)
+		{
+			if (command->str[cmd_len - 1] == '\n')
+			{
+				if (cmd_len == 1)
 				{
-					found_space = 0;
-					break;
+					continue;
+				}
+				else
+				{
+					command->str[cmd_len - 1] = '\0';
 				}
 			}
+		}
 
-			if (found_space)
-			{
-				// Found enough space after already allocated block
-				fs_set_free_blocks(inode->start_block + size, inode->start_block + new_size - 1, 1);
-				inode->used_size = 0x80 | new_size;
+		command->line_num = line_num++;
+		fs_parse(command);
+		command_queue.push();
+	}
 
-				// Update superblock on disk
-				lseek(fs_fd, 0, SEEK_SET);
-				write(fs_fd, fs_sb.free_block_list, 16);
-				lseek(fs_fd, (inode_index + 2) * 8, SEEK_SET);
-				write(fs_fd, inode, 8);
+	command_queue.write_slot()->type = CMD_END;
+	command_queue.push();
+}
 
+
+/**
+* @brief 	Run reads handed off by executor until stopped
+*/
+void fs_reader_worker(void)
+{
+	while (1)
+	{
+		Command_output *task;
+		{
+			std::unique_lock<std::mutex> lock(reader_mutex);
+			reader_cond.wait(lock, [] { return reader_stop || !reader_queue.empty(); });
+			if (reader_queue.empty())
+			{
 				return;
 			}
+			task = reader_queue.front();
+			reader_queue.pop_front();
 		}
 
-		// Save existing free block list and remove allocated blocks from list
-		char saved_free_block_list[16];
-		memcpy(saved_free_block_list, fs_sb.free_block_list, 16);
-		fs_set_free_blocks(inode->start_block, inode->start_block + size - 1, 0);
-
-		uint8_t start_block_num = 0;
+		// Pinned version is never changed, so it is read without locks
+		const Fs_snapshot *snap = task->snap;
+		if (snap == NULL)
+		{
+			task->err = "Error: No file system is mounted\n";
+		}
+		else if (task->type == CMD_LS)
+		{
+			fs_ls_format(&snap->sb, snap->dir_map, snap->file_maps, task->dir, task->out);
+		}
+		else
+		{
+			fs_find_format(&snap->sb, snap->name_index, task->pattern, task->out);
+			if (task->out.empty())
+			{
+				task->err = std::string("Error: File or directory ") + task->pattern + " does not exist\n";
+			}
+		}
 
-		for (uint8_t i = 0; i < 16; i++)
+		snapshots.unpin(task->pin);
 		{
-			char fb_byte = fs_sb.free_block_list[i];
+			std::lock_guard<std::mutex> lock(reader_mutex);
+			task->done.store(1, std::memory_order_release);
+		}
+		output_cond.notify_all();
+	}
+}
+
+
+/**
+* @brief 	Hand L or find to a reader thread, with the metadata version as of
+* 			this point of the input
+* @param 	command - decoded L or find command
+*/
+void fs_dispatch_read(Command *command)
+{
+	if (snapshot_stale && (fs_fd >= 0))
+	{
+		// New version is built aside and swapped in, so pinned versions
+		// stay as they were
+		Fs_snapshot *snap = new Fs_snapshot;
+		snap->sb = fs_sb;
+		snap->dir_map = dir_map;
+		snap->file_maps = file_maps;
+		snap->name_index = name_index;
+		snapshots.publish(snap);
+		snapshot_stale = 0;
+	}
+
+	Command_output *task = new Command_output;
+	task->type = command->type;
+	task->dir = curr_dir;
+	strncpy(task->pattern, (command->type == CMD_FIND) ? command->args[1] : "", sizeof(task->pattern) - 1);
+	task->pattern[sizeof(task->pattern) - 1] = 0;
+	task->snap = snapshots.pin(&task->pin);
+	task->done.store(0, std::memory_order_relaxed);
+	output_queue.push_back(task);
 
-			for (uint8_t j = 0; j < 8; j++)
+	while ((int) readers.size() < reader_count)
+	{
+		readers.push_back(std::thread(fs_reader_worker));
+	}
+
+	std::lock_guard<std::mutex> lock(reader_mutex);
+	reader_queue.push_back(task);
+	reader_cond.notify_one();
+}
+
+
+/**
+* @brief 	Execute command while earlier reads may still print, keeping its
+* 			output until they have
+* @param 	command - decoded command
+* @param 	file_name - input file name used in error messages
+*/
+void fs_execute_held(Command *command, char *file_name)
+{
+	char *out_buff = NULL;
+	char *err_buff = NULL;
+	size_t out_len = 0;
+	size_t err_len = 0;
+	FILE *out_fp = open_memstream(&out_buff, &out_len);
+	FILE *err_fp = open_memstream(&err_buff, &err_len);
+
+	// Only streams of this thread are replaced, reader threads write to
+	// their own output
+	FILE *saved_out = fs_out;
+	FILE *saved_err = fs_err;
+	fs_out = out_fp;
+	fs_err = err_fp;
+	fs_execute(command, file_name);
+	fs_out = saved_out;
+	fs_err = saved_err;
+	fclose(out_fp);
+	fclose(err_fp);
+
+	Command_output *output = new Command_output;
+	output->type = command->type;
+	output->out.assign(out_buff, out_len);
+	output->err.assign(err_buff, err_len);
+	output->done.store(1, std::memory_order_relaxed);
+	output_queue.push_back(output);
+	free(out_buff);
+	free(err_buff);
+}
+
+
+/**
+* @brief 	Print outputs in command order, up to the first unfinished read
+* @param 	wait - 1 to wait for every read to finish
+*/
+void fs_print_outputs(uint8_t wait)
+{
+	while (!output_queue.empty())
+	{
+		Command_output *output = output_queue.front();
+		if (output->done.load(std::memory_order_acquire) == 0)
+		{
+			if (wait == 0)
 			{
-				uint8_t block_num = (i * 8) + j;
-				if (CHECK_BIT(fb_byte, 7 - j) == 0)
-				{
-					if (start_block_num == 0)
-					{
-						// First empty block
-						start_block_num = block_num;
-					}
+				return;
+			}
 
-					if ((start_block_num + new_size - 1) == block_num)
-					{
-						// Reserve blocks in free block list
-						fs_set_free_blocks(start_block_num, block_num, 1);
-						found_space = 1;
-						break;
-					}
-				}
-				else
-				{
-					start_block_num = 0;
-				}
+			// Spin briefly, then sleep until a reader finishes
+			for (int i = 0; (i < QUEUE_SPINS) && (output->done.load(std::memory_order_acquire) == 0); i++)
+			{
+				std::this_thread::yield();
 			}
+			std::unique_lock<std::mutex> lock(reader_mutex);
+			output_cond.wait(lock, [output] { return output->done.load(std::memory_order_acquire) != 0; });
+			continue;
+		}
 
-			if (found_space)
+		fwrite(output->out.data(), 1, output->out.size(), stdout);
+		fwrite(output->err.data(), 1, output->err.size(), stderr);
+		delete output;
+		output_queue.pop_front();
+	}
+}
+
+
+/**
+* @brief 	Resolve read or write that can run on a worker thread, which is
+* 			one that prints nothing and leaves metadata unchanged
+* @param 	command - decoded command
+* @param 	task - task that will hold file and data block of command
+* @return 	1 if command can be handed off, otherwise 0
+*/
+uint8_t fs_plan_data(Command *command, Data_task *task)
+{
+	int inode_index;
+	int size;
+	switch (command->type)
+	{
+		case CMD_READ:
+		case CMD_WRITE:
+			inode_index = fs_search_curr_dir(command->args[1]);
+			if ((inode_index < 0) || CHECK_FLAG(fs_sb.inode[inode_index].dir_parent))
 			{
-				// Move data
-				uint8_t buff[1024];
-				uint8_t empty_buff[1024] = {0};
-				for (uint8_t i = 0; i < size; i++)
-				{
-					lseek(fs_fd, (inode->start_block + i) * 1024, SEEK_SET);
-					read(fs_fd, buff, 1024);
+				return 0;
+			}
+			size = fs_file_size(inode_index);
+			break;
+		case CMD_HREAD:
+		case CMD_HWRITE:
+			if (handles[command->handle].open == 0)
+			{
+				return 0;
+			}
+			inode_index = handles[command->handle].inode_index;
+			size = handles[command->handle].size;
+			break;
+		default:
+			return 0;
+	}
+
+	if (command->num >= size)
+	{
+		return 0;
+	}
 
-					lseek(fs_fd, (start_block_num + i) * 1024, SEEK_SET);
-					write(fs_fd, buff, 1024);
+	task->type = ((command->type == CMD_READ) || (command->type == CMD_HREAD)) ? CMD_READ : CMD_WRITE;
+	task->inode_index = inode_index;
+	task->block_num = command->num;
+	task->data_block = fs_file_block(inode_index, command->num);
 
-					lseek(fs_fd, (inode->start_block + i) * 1024, SEEK_SET);
-					write(fs_fd, empty_buff, 1024);
-				}
+	// Allocating a block of a sparse file or copying a shared block changes
+	// the free block list, and a checksum mismatch prints an error
+	if (((task->type == CMD_WRITE) && ((task->data_block == 0) || fs_is_shared(task->data_block))) || ((task->type == CMD_READ) && checksum_mode))
+	{
+		return 0;
+	}
 
-				// Update inode
-				inode->used_size = 0x80 | new_size;
-				inode->start_block = start_block_num;
+	strncpy(task->command, command->args[0], sizeof(task->command));
+	task->line_num = command->line_num;
+	return 1;
+}
 
-				// Update superblock on disk
-				lseek(fs_fd, 0, SEEK_SET);
-				write(fs_fd, fs_sb.free_block_list, 16);
-				lseek(fs_fd, (inode_index + 2) * 8, SEEK_SET);
-				write(fs_fd, inode, 8);
 
+/**
+* @brief 	Run reads and writes handed off by executor until stopped
+*/
+void fs_data_worker(void)
+{
+	while (1)
+	{
+		Data_task *task;
+		{
+			std::unique_lock<std::mutex> lock(data_mutex);
+			data_cond.wait(lock, [] { return data_stop || !data_ready.empty(); });
+			if (data_ready.empty())
+			{
 				return;
 			}
+			task = data_ready.front();
+			data_ready.pop_front();
 		}
 
-		// Restore free block list and reject new size
-		memcpy(fs_sb.free_block_list, saved_free_block_list, 16);
-		fprintf(stderr, "Error: File %s cannot expand to size %d\n", name, new_size);
-	}
-	else if (new_size < size)
-	{
-		// Delete data from blocks to deallocate
-		size_t size = inode->used_size & 0x7F;
-		uint8_t empty_buff[1024] = {0};
-		for (uint8_t i = 0; i < (size - new_size); i++)
+		io_set_command(task->command, task->line_num);
+		if (task->type == CMD_WRITE)
 		{
-			lseek(fs_fd, (inode->start_block + new_size + i) * 1024, SEEK_SET);
-			write(fs_fd, empty_buff, 1024);
+			memcpy(data_buffer, &(*task->buff)[0], FS_BLOCK_SIZE);
+			fs_write_data(task->inode_index, task->block_num, task->data_block);
+		}
+		else
+		{
+			fs_read_data(task->inode_index, task->block_num, task->data_block);
+			memcpy(&(*task->buff)[0], data_buffer, FS_BLOCK_SIZE);
 		}
 
-		// Update superblock
-		fs_set_free_blocks(inode->start_block + new_size, inode->start_block + size - 1, 0);
-		inode->used_size = 0x80 | new_size;
-
-		// Update superblock on disk
-		lseek(fs_fd, 0, SEEK_SET);
-		write(fs_fd, fs_sb.free_block_list, 16);
-		lseek(fs_fd, (inode_index + 2) * 8, SEEK_SET);
-		write(fs_fd, inode, 8);
+		// Later tasks that waited for this one can run
+		{
+			std::lock_guard<std::mutex> lock(data_mutex);
+			for (size_t i = 0; i < task->dependents.size(); i++)
+			{
+				if (--task->dependents[i]->waiting == 0)
+				{
+					data_ready.push_back(task->dependents[i]);
+				}
+			}
+			task->done = 1;
+			data_running--;
+		}
+		data_cond.notify_all();
 	}
 }
 
 
 /**
-* @brief 	Defragment disk
+* @brief 	Wait for every read and write handed off, and load buffer of
+* 			executor with contents left by the last of them
 */
-void fs_defrag(void)
+void fs_wait_data(void)
 {
-	if (fs_fd < 0)
+	if (data_tasks.empty() && (data_version == NULL))
 	{
-		// No file system mounted
-		fprintf(stderr, "Error: No file system is mounted\n");
 		return;
 	}
 
-	std::priority_queue<uint8_t, std::vector<uint8_t>, custom_compare> inodes;
+	{
+		std::unique_lock<std::mutex> lock(data_mutex);
+		data_cond.wait(lock, [] { return data_running == 0; });
+	}
 
-	// Arrange inodes in order they appear on disk
-	for (uint8_t i = 0; i < 126; i++)
+	if (data_version != NULL)
 	{
-		Inode *inode = &fs_sb.inode[i];
-		if (CHECK_BIT(inode->used_size, 7))
+		memcpy(data_buffer, &(*data_version)[0], FS_BLOCK_SIZE);
+		data_version.reset();
+	}
+	data_producer = NULL;
+
+	for (size_t i = 0; i < data_tasks.size(); i++)
+	{
+		delete data_tasks[i];
+	}
+	data_tasks.clear();
+	inode_tasks.clear();
+	block_tasks.clear();
+}
+
+
+/**
+* @brief 	Add task as dependent of earlier task it conflicts with, unless
+* 			that task has finished, with data_mutex held
+* @param 	task - new task
+* @param 	earlier - earlier task, NULL if none
+*/
+void fs_add_dependency(Data_task *task, Data_task *earlier)
+{
+	if ((earlier == NULL) || earlier->done)
+	{
+		return;
+	}
+
+	// Same task can be the last one of file, data block and buffer
+	for (size_t i = 0; i < earlier->dependents.size(); i++)
+	{
+		if (earlier->dependents[i] == task)
 		{
-			if (CHECK_BIT(inode->dir_parent, 7) == 0)
-			{
-				inodes.push(i);
-			}
+			return;
 		}
 	}
 
-	// Set first available block to 1
-	uint8_t next_available_block = 1;
+	earlier->dependents.push_back(task);
+	task->waiting++;
+}
+
+
+/**
+* @brief 	Hand B, or R, W, hread or hwrite that touches no metadata, to
+* 			worker threads, after every earlier task it conflicts with
+* @param 	command - decoded command
+* @return 	1 if command was handed off, 0 if it has to run on executor
+*/
+uint8_t fs_dispatch_data(Command *command)
+{
+	if (fs_fd < 0)
+	{
+		return 0;
+	}
 
-	while(!inodes.empty())
+	if (command->type == CMD_BUFF)
 	{
-		uint8_t inode_index = inodes.top();
+		// Filled buffer is a new version, so tasks still using the
+		// previous one are not waited for
+		data_version = std::make_shared< std::vector<uint8_t> >((size_t) FS_BLOCK_SIZE, 0);
+		memcpy(&(*data_version)[0], command->args[1], strlen(command->args[1]));
+		data_producer = NULL;
+		return 1;
+	}
 
-		Inode *inode = &fs_sb.inode[inode_index];
-		uint8_t size = inode->used_size & 0x7F;
+	Data_task plan;
+	if (fs_plan_data(command, &plan) == 0)
+	{
+		return 0;
+	}
 
-		// Check if file is occupying next "avaliable" block
-		if (next_available_block < inode->start_block)
-		{
-			// Shift data
-			uint8_t buff[1024];
-			uint8_t empty_buff[1024] = {0};
-			for (uint8_t i = 0; i < size; i++)
-			{
-				lseek(fs_fd, (inode->start_block + i) * 1024, SEEK_SET);
-				read(fs_fd, buff, 1024);
+	if (data_tasks.size() >= DATA_WINDOW)
+	{
+		fs_wait_data();
+	}
 
-				lseek(fs_fd, (next_available_block + i) * 1024, SEEK_SET);
-				write(fs_fd, buff, 1024);
+	while ((int) workers.size() < worker_count)
+	{
+		workers.push_back(std::thread(fs_data_worker));
+	}
 
-				lseek(fs_fd, (inode->start_block + i) * 1024, SEEK_SET);
-				write(fs_fd, empty_buff, 1024);
-			}
+	Data_task *task = new Data_task(plan);
+	task->waiting = 0;
+	task->done = 0;
+	data_tasks.push_back(task);
 
-			// Update inode on disk
-			inode->start_block = next_available_block;
-			lseek(fs_fd, (inode_index + 2) * 8, SEEK_SET);
-			write(fs_fd, inode, 8);
-		}
+	if (data_version == NULL)
+	{
+		data_version = std::make_shared< std::vector<uint8_t> >(data_buffer, data_buffer + FS_BLOCK_SIZE);
+	}
 
-		// Update next "available" block
-		next_available_block = inode->start_block + size;
+	std::lock_guard<std::mutex> lock(data_mutex);
+	if (task->type == CMD_WRITE)
+	{
+		// Write takes buffer as left by the commands before it
+		task->buff = data_version;
+		fs_add_dependency(task, data_producer);
+	}
+	else
+	{
+		task->buff = std::make_shared< std::vector<uint8_t> >((size_t) FS_BLOCK_SIZE);
+		data_version = task->buff;
+		data_producer = task;
+	}
 
-		inodes.pop();
+	// Tasks on the same file or data block run in command order
+	std::map< uint8_t, Data_task * >::iterator it = inode_tasks.find(task->inode_index);
+	fs_add_dependency(task, (it != inode_tasks.end()) ? it->second : NULL);
+	inode_tasks[task->inode_index] = task;
+	if (task->data_block != 0)
+	{
+		it = block_tasks.find(task->data_block);
+		fs_add_dependency(task, (it != block_tasks.end()) ? it->second : NULL);
+		block_tasks[task->data_block] = task;
 	}
 
-	// Update free block list on disk
-	fs_set_free_blocks(0, next_available_block - 1, 1);
-	if (next_available_block < 128)
+	data_running++;
+	if (task->waiting == 0)
 	{
-		fs_set_free_blocks(next_available_block, 127, 0);
+		data_ready.push_back(task);
+		data_cond.notify_one();
 	}
-	lseek(fs_fd, 0, SEEK_SET);
-	write(fs_fd, fs_sb.free_block_list, 16);
+
+	return 1;
 }
 
 
 /**
-* @brief 	Change working directory
-* @param 	name - name of directory to change to
+* @brief 	Add counters of executed command to total of its type
+* @param 	command - decoded command
+* @param 	before - counters read before command
 */
-void fs_cd(char name[5])
+void fs_perf_add(Command *command, const uint64_t before[PERF_COUNTERS])
 {
-	if (fs_fd < 0)
-	{
-		// No file system mounted
-		fprintf(stderr, "Error: No file system is mounted\n");
-		return;
-	}
+	uint64_t after[PERF_COUNTERS];
+	perf_read(after);
 
-	if (strcmp(name, ".") == 0)
+	Perf_total &total = perf_totals[(command->type == CMD_INVALID) ? "?" : command->args[0]];
+	total.count++;
+	for (int i = 0; i < PERF_COUNTERS; i++)
 	{
-		// Already in current working directory
-		return;
+		total.value[i] += after[i] - before[i];
 	}
+}
 
-	if (strcmp(name, "..") == 0)
-	{
-		if (curr_dir != 127)
-		{
-			// Change to parent directory
-			Inode *inode = &fs_sb.inode[curr_dir];
-			uint8_t parent = inode->dir_parent & 0x7F;
-			curr_dir = parent;
-		}
-		return;
-	}
 
-	int inode_index = fs_search_curr_dir(name);
-	if (inode_index < 0)
+/**
+* @brief 	Format ratio of two counters, or - if either was not counted
+* @param 	out - string that will contain ratio
+* @param 	len - size of out
+* @param 	format - printf format of ratio
+* @param 	num - numerator counter
+* @param 	den - denominator counter
+* @param 	total - counters of command type
+* @param 	scale - factor ratio is multiplied by
+*/
+void fs_perf_ratio(char *out, size_t len, const char *format, int num, int den, const Perf_total &total, double scale)
+{
+	if (!perf_available(num) || !perf_available(den) || (total.value[den] == 0))
 	{
-		// Cannot find directory with given name
-		fprintf(stderr, "Error: Directory %s does not exist\n", name);
+		snprintf(out, len, "-");
 		return;
 	}
 
-	Inode *inode = &fs_sb.inode[inode_index];
-	if (CHECK_BIT(inode->dir_parent, 7) == 0)
+	snprintf(out, len, format, scale * total.value[num] / total.value[den]);
+}
+
+
+/**
+* @brief 	Print counters of every command type, with instructions per
+* 			cycle and miss rates
+*/
+void fs_perf_print(void)
+{
+	fprintf(fs_err, "%-8s %6s %9s %11s %6s %8s %8s %8s\n", "command", "count", "cpu ms", "cycles/cmd", "IPC",
+		"cache%", "branch%", "br MPKI");
+
+	std::map< std::string, Perf_total >::iterator it;
+	for (it = perf_totals.begin(); it != perf_totals.end(); it++)
 	{
-		// Given name belongs to file
-		fprintf(stderr, "Error: Directory %s does not exist\n", name);
-		return;
+		const Perf_total &total = it->second;
+		char cpu[16], cycles[16], ipc[16], cache[16], branch[16], mpki[16];
+		snprintf(cpu, sizeof(cpu), perf_available(PERF_TASK_CLOCK) ? "%.3f" : "-", total.value[PERF_TASK_CLOCK] / 1e6);
+		snprintf(cycles, sizeof(cycles), perf_available(PERF_CYCLES) ? "%llu" : "-",
+			(unsigned long long) (total.value[PERF_CYCLES] / total.count));
+		fs_perf_ratio(ipc, sizeof(ipc), "%.2f", PERF_INSTRUCTIONS, PERF_CYCLES, total, 1);
+		fs_perf_ratio(cache, sizeof(cache), "%.1f", PERF_CACHE_MISSES, PERF_CACHE_REFERENCES, total, 100);
+		fs_perf_ratio(branch, sizeof(branch), "%.2f", PERF_BRANCH_MISSES, PERF_BRANCHES, total, 100);
+		fs_perf_ratio(mpki, sizeof(mpki), "%.2f", PERF_BRANCH_MISSES, PERF_INSTRUCTIONS, total, 1000);
+
+		fprintf(fs_err, "%-8s %6d %9s %11s %6s %8s %8s %8s\n", it->first.c_str(), total.count, cpu, cycles, ipc,
+			cache, branch, mpki);
 	}
-
-	// Update current working directory
-	curr_dir = inode_index;
 }
 
 
 int main(int argc, char **argv)
 {
+    int opt;
+    while ((opt = getopt(argc, argv, "sodcklPrut:v:j:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                // Create sparse files
+                sparse_mode = 1;
+                break;
+            case 'o':
+                // Mount disks as copy-on-write overlays
+                overlay_mode = 1;
+                break;
+            case 'c':
+                // Trust disks that were cleanly unmounted
+                clean_mode = 1;
+                break;
+            case 'l':
+                // Place files of a directory near each other
+                locality_mode = 1;
+                break;
+            case 'k':
+                // Verify blocks against their checksums
+                checksum_mode = 1;
+                break;
+            case 'd':
+                // Bypass page cache for disk I/O
+                direct_mode = 1;
+                break;
+            case 'v':
+                // Run L and find on reader threads
+                reader_count = atoi(optarg);
+                if ((reader_count < 1) || (reader_count > MAX_READERS))
+                {
+                    fprintf(fs_err, "Error: Invalid number of reader threads\n");
+                    return -1;
+                }
+                break;
+            case 'r':
+                // Detach deleted directories and reclaim them later
+                orphan_mode = 1;
+                break;
+            case 'u':
+                // Merge identical data blocks when defragmenting
+                dedup_mode = 1;
+                break;
+            case 'P':
+                // Count hardware events of every command
+                perf_mode = 1;
+                break;
+            case 'j':
+                // Run reads and writes on worker threads
+                worker_count = atoi(optarg);
+                if ((worker_count < 1) || (worker_count > MAX_WORKERS))
+                {
+                    fprintf(fs_err, "Error: Invalid number of worker threads\n");
+                    return -1;
+                }
+                break;
+            case 't':
+                // Record every disk access to trace file
+                if (io_trace_open(optarg) < 0)
+                {
+                    fprintf(fs_err, "Error: Cannot create trace file %s\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                fprintf(fs_err, "Error: Invalid number of arguments\n");
+                return -1;
+        }
+    }
+
     // Only handle one input file
-    if (argc != 2)
+    if (argc - optind != 1)
     {
-        fprintf(stderr, "Error: Invalid number of arguments\n");
+        fprintf(fs_err, "Error: Invalid number of arguments\n");
         return -1;
     }
 
     // Open file for reading
-    char *file_name = argv[1];
+    char *file_name = argv[optind];
     FILE *fp = fopen(file_name, "r");
     if (fp == NULL)
     {
-        fprintf(stderr, "Error: Failed to open input file\n");
+        fprintf(fs_err, "Error: Failed to open input file\n");
         return -1;
     }
 
-    char cmd_str[CMD_MAX_SIZE];
-    int line_num = 1;
-
-    // Read one line from input file at a time
-    while (fgets(cmd_str, CMD_MAX_SIZE, fp) != NULL)
-    {
-		// Strip newline character or continue if empty command
-		size_t cmd_len = strlen(cmd_str);
-		if (cmd_len > 0)
+	if (perf_mode)
+	{
+		// Commands still run and are counted without counters
+		if (perf_open() == 0)
 		{
-			if (cmd_str[cmd_len - 1] == '\n')
-			{
-				if (cmd_len == 1)
-				{
-					continue;
-				}
-				else
-				{
-					cmd_str[cmd_len - 1] = '\0';
-				}
-			}
+			fprintf(fs_err, "Warning: Performance counters are not available\n");
 		}
+		else if (!perf_available(PERF_CYCLES) || !perf_available(PERF_INSTRUCTIONS))
+		{
+			fprintf(fs_err, "Warning: Hardware performance counters are not available, only CPU time is counted\n");
+		}
+	}
 
-        char *cmd_args[4] = {NULL};
-        uint8_t cmd_args_num = fs_tokenize(cmd_str, cmd_args);
-
-        char *cmd = cmd_args[0];
-
-        if (strcmp(cmd, "M") == 0)
-        {
-			if (cmd_args_num == 2)
-            {
-                char *new_disk_name = cmd_args[1];
-
-                fs_mount(new_disk_name);
-				line_num++;
-                continue;
-            }
-        }
-        else if (strcmp(cmd, "C") == 0)
-        {
-			if (cmd_args_num == 3)
-            {
-                char *name = cmd_args[1];
-                int size = atoi(cmd_args[2]);
+	// Parse input on its own thread while commands execute on this one
+	std::thread parser(fs_parse_input, fp);
 
-                if ((strlen(name) <= 5) && (size >= 0) && (size <= 127))
-                {
-					fs_create(name, size);
-					line_num++;
-                    continue;
-                }
-            }
-        }
-        else if (strcmp(cmd, "D") == 0)
-        {
-            if (cmd_args_num == 2)
-            {
-                char *name = cmd_args[1];
+	while (1)
+	{
+		Command *command = command_queue.read_slot();
+		if (command->type == CMD_END)
+		{
+			command_queue.pop();
+			break;
+		}
 
-                if (strlen(name) <= 5)
-                {
-                    fs_delete(name);
-					line_num++;
-                    continue;
-                }
-            }
-        }
-        else if (strcmp(cmd, "R") == 0)
-        {
-            if (cmd_args_num == 3)
-            {
-                char *name = cmd_args[1];
-                int block_num = atoi(cmd_args[2]);
+		if (command->type != CMD_INVALID)
+		{
+			io_trace_command(command->args[0], command->line_num);
+		}
 
-                if ((strlen(name) <= 5) && (block_num >= 0) && (block_num <= 126))
-                {
-                    fs_read(name, block_num);
-					line_num++;
-                    continue;
-                }
-            }
-        }
-        else if (strcmp(cmd, "W") == 0)
-        {
-            if (cmd_args_num == 3)
-            {
-                char *name = cmd_args[1];
-                int block_num = atoi(cmd_args[2]);
+		uint64_t before[PERF_COUNTERS];
+		if (perf_mode)
+		{
+			perf_read(before);
+		}
 
-                if ((strlen(name) <= 5) && (block_num >= 0) && (block_num <= 126))
-                {
-                    fs_write(name, block_num);
-					line_num++;
-                    continue;
-                }
-            }
-        }
-        else if (strcmp(cmd, "B") == 0)
-        {
-            if (cmd_args_num == 2)
-            {
-                if (strlen(cmd_args[1]) <= 1024)
-                {
-                    uint8_t *buff = (uint8_t *) cmd_args[1];
+		if (worker_count && fs_dispatch_data(command))
+		{
+			// Reads and writes print nothing, so their output is not held
+		}
+		else if (reader_count && ((command->type == CMD_LS) || (command->type == CMD_FIND)))
+		{
+			fs_dispatch_read(command);
+		}
+		else
+		{
+			// Every other command may change metadata or print, so it runs
+			// once every read and write before it has finished
+			fs_wait_data();
+			if (output_queue.empty())
+			{
+				fs_execute(command, file_name);
+			}
+			else
+			{
+				fs_execute_held(command, file_name);
+			}
+			snapshot_stale = 1;
+		}
+		if (perf_mode)
+		{
+			fs_perf_add(command, before);
+		}
 
-                    fs_buff(buff);
-					line_num++;
-                    continue;
-                }
-            }
-        }
-        else if (strcmp(cmd, "L") == 0)
-        {
-            if (cmd_args_num == 1)
-            {
-                fs_ls();
-				line_num++;
-                continue;
-            }
-        }
-        else if (strcmp(cmd, "E") == 0)
-        {
-            if (cmd_args_num == 3)
-            {
-                char *name = cmd_args[1];
-                int new_size = atoi(cmd_args[2]);
+		if (orphan_mode && data_tasks.empty())
+		{
+			// Files of detached directories are freed a few at a time, while
+			// no reads or writes are handed off
+			io_set_command("reclaim", command->line_num);
+			if (fs_reclaim(RECLAIM_BATCH))
+			{
+				snapshot_stale = 1;
+			}
+		}
+		fs_print_outputs(0);
+		command_queue.pop();
+	}
 
-                if ((strlen(name) <= 5) && (new_size > 0) && (new_size <= 127))
-                {
-					fs_resize(name, new_size);
-					line_num++;
-                    continue;
-                }
-            }
-        }
-        else if (strcmp(cmd, "O") == 0)
-        {
-			if (cmd_args_num == 1)
-            {
-                fs_defrag();
-				line_num++;
-                continue;
-            }
-        }
-        else if (strcmp(cmd, "Y") == 0)
-        {
-            if (cmd_args_num == 2)
-            {
-                char *name = cmd_args[1];
+	parser.join();
 
-                if (strlen(name) <= 5)
-                {
-                    fs_cd(name);
-					line_num++;
-                    continue;
-                }
-            }
-        }
+	// Finish last reads and writes and stop worker threads
+	fs_wait_data();
+	{
+		std::lock_guard<std::mutex> lock(data_mutex);
+		data_stop = 1;
+	}
+	data_cond.notify_all();
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
 
-		// Invalid command
-        fprintf(stderr, "Command Error: %s, %d\n", file_name, line_num);
-        line_num++;
-    }
+	// Print outputs of last reads and stop reader threads
+	fs_print_outputs(1);
+	{
+		std::lock_guard<std::mutex> lock(reader_mutex);
+		reader_stop = 1;
+	}
+	reader_cond.notify_all();
+	for (size_t i = 0; i < readers.size(); i++)
+	{
+		readers[i].join();
+	}
 
 	// Close disk
 	if (fs_fd >= 0)
 	{
-		close(fs_fd);
+		fs_reclaim(RECLAIM_ALL);
+		fs_meta_write(1);
+		fs_sums_write();
+		io_detach();
+		io_close(fs_dev);
+	}
+	io_trace_close();
+
+	if (perf_mode)
+	{
+		fs_perf_print();
+		perf_close();
 	}
     fclose(fp);
 
@@ -1,25 +1,34 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include "Geometry.h"
 
-typedef struct {
-	char name[5];        // Name of the file or directory
-	uint8_t used_size;   // Inode state and the size of the file or directory
-	uint8_t start_block; // Index of the start file block
-	uint8_t dir_parent;  // Inode mode and the index of the parent inode
-} Inode;
+typedef Fs_geometry::Inode Inode;
+typedef Fs_geometry::Super_block Super_block;
+typedef Fs_geometry::Block_map Block_map;
 
-typedef struct {
-	char free_block_list[16];
-	Inode inode[126];
-} Super_block;
-
-void fs_mount(char *new_disk_name);
+void fs_mount(char *new_disk_name, char *delta_name);
 void fs_create(char name[5], int size);
 void fs_delete(char name[5]);
 void fs_read(char name[5], int block_num);
 void fs_write(char name[5], int block_num);
-void fs_buff(uint8_t buff[1024]);
+void fs_buff(uint8_t buff[Fs_geometry::BLOCK_SIZE]);
 void fs_ls(void);
 void fs_resize(char name[5], int new_size);
 void fs_defrag(void);
-void fs_cd(char name[5]);
\ No newline at end of file
+void fs_cd(char name[5]);
+void fs_overlay(char *action, char *delta_name);
+void fs_move(char name[5], char *dest);
+void fs_du(void);
+void fs_tree(void);
+void fs_find(char *pattern);
+void fs_locality(void);
+void fs_import(char *host_path, off_t offset, size_t length, char name[5], int block_num);
+void fs_export(char name[5], int block_num, size_t length, char *host_path, off_t offset);
+void fs_scrub(int threads);
+void fs_dedup(void);
+void fs_open(char name[5]);
+void fs_close(int handle);
+void fs_hread(int handle, int block_num);
+void fs_hwrite(int handle, int block_num);
+void fs_hresize(int handle, int new_size);
\ No newline at end of file
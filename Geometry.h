@@ -0,0 +1,221 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+// Layout of a disk, fixed at compile time. Block 0 holds the superblock,
+// which is the free block list followed by the inode table. The top bit of
+// used_size marks an inode as used and the top bit of dir_parent marks it as
+// a directory, the remaining bits hold the size in blocks and the index of
+// the parent inode. Every loop bound and offset below is a constant, so
+// scans are unrolled and vectorized separately for each geometry.
+template <uint32_t Block_size, uint32_t Block_count, uint32_t Inode_count, uint32_t Name_len>
+struct Geometry
+{
+	static const uint32_t BLOCK_SIZE = Block_size;
+	static const uint32_t BLOCK_COUNT = Block_count;
+	static const uint32_t INODE_COUNT = Inode_count;
+	static const uint32_t NAME_LEN = Name_len;
+
+	// Inode field, wide enough for a block or inode index and the top bit
+	typedef typename std::conditional<(Block_count <= 128) && (Inode_count < 127), uint8_t, uint32_t>::type Field;
+
+	static const Field FLAG = (Field) 1 << (sizeof(Field) * 8 - 1);
+	static const Field MASK = FLAG - 1;
+
+	// Parent index of inodes in root directory
+	static const uint32_t ROOT = MASK;
+
+	// Largest file, in blocks
+	static const uint32_t MAX_FILE_BLOCKS = ((Block_count - 1) < MASK) ? (Block_count - 1) : MASK;
+
+	// Entries of a block map, limited by the largest file and the block size
+	static const uint32_t MAP_ENTRIES = (MAX_FILE_BLOCKS < (Block_size / sizeof(Field) - 1)) ?
+		MAX_FILE_BLOCKS : (Block_size / sizeof(Field) - 1);
+
+	static const uint32_t FREE_LIST_SIZE = Block_count / 8;
+
+	typedef struct {
+		char name[Name_len];  // Name of the file or directory
+		Field used_size;      // Inode state and the size of the file or directory
+		Field start_block;    // Index of the start file block
+		Field dir_parent;     // Inode mode and the index of the parent inode
+	} Inode;
+
+	typedef struct {
+		char free_block_list[Block_count / 8];
+		Inode inode[Inode_count];
+	} Super_block;
+
+	// A file inode with a size of zero is a mapped file. Its start block
+	// holds the block map below instead of the first data block of the file.
+	// A sparse file allocates blocks when first written, other mapped files
+	// have their blocks allocated up front.
+	typedef struct {
+		Field size;                // Sparse flag and the logical size of the file
+		Field block[MAP_ENTRIES];  // Data block of each file block, 0 if not yet written
+	} Block_map;
+
+	// Blocks taken by the superblock at the start of the disk
+	static const uint32_t SUPER_BLOCKS = (sizeof(Super_block) + Block_size - 1) / Block_size;
+
+	// Offset of inode table on disk
+	static const uint32_t INODE_OFFSET = offsetof(Super_block, inode);
+
+	static_assert((Block_size & (Block_size - 1)) == 0, "Block size must be a power of two");
+	static_assert((Block_count % 8) == 0, "Free block list must fill whole bytes");
+	static_assert(Inode_count < ROOT, "Inode indices must not collide with root directory");
+	static_assert(Block_count - 1 <= MASK, "Start block must fit in inode");
+	static_assert(sizeof(Block_map) <= Block_size, "Block map must fit in one block");
+
+	/**
+	* @brief 	Check if block is free in free block list
+	* @param 	list - free block list
+	* @param 	block_num - block to check
+	* @return 	1 if free, otherwise 0
+	*/
+	static uint8_t is_free(const char *list, uint32_t block_num)
+	{
+		return ((list[block_num / 8] >> (7 - (block_num % 8))) & 1) == 0;
+	}
+
+	/**
+	* @brief 	Set bits to value in free block list
+	* @param 	list - free block list
+	* @param 	start_block - first block to set to value
+	* @param 	end_block - end block to set to value
+	* @param 	value - 0 or 1
+	*/
+	static void set_blocks(char *list, uint32_t start_block, uint32_t end_block, uint8_t value)
+	{
+		for (uint32_t i = start_block; (i <= end_block) && (i < Block_count); i++)
+		{
+			if (value == 0)
+			{
+				list[i / 8] &= ~(1 << (7 - (i % 8)));
+			}
+			else
+			{
+				list[i / 8] |= (1 << (7 - (i % 8)));
+			}
+		}
+	}
+
+	/**
+	* @brief 	Count free blocks in free block list
+	* @param 	list - free block list
+	* @return 	number of free blocks
+	*/
+	static uint32_t count_free(const char *list)
+	{
+		uint32_t count = 0;
+		for (uint32_t i = 0; i < Block_count / 8; i++)
+		{
+			count += 8 - __builtin_popcount((uint8_t) list[i]);
+		}
+		return count;
+	}
+
+	/**
+	* @brief 	Find first run of free blocks in free block list
+	* @param 	list - free block list
+	* @param 	count - number of blocks in run
+	* @param 	first - block to start searching from
+	* @return 	0 if no run is free, otherwise first block of run
+	*/
+	static uint32_t find_run(const char *list, uint32_t count, uint32_t first = 1)
+	{
+		uint32_t start = 0;
+		for (uint32_t i = first; i < Block_count; i++)
+		{
+			if ((uint8_t) list[i / 8] == 0xFF)
+			{
+				// Skip full byte
+				start = 0;
+				i |= 7;
+				continue;
+			}
+
+			if (is_free(list, i) == 0)
+			{
+				start = 0;
+				continue;
+			}
+
+			if (start == 0)
+			{
+				start = i;
+			}
+			if (i - start + 1 == count)
+			{
+				return start;
+			}
+		}
+
+		return 0;
+	}
+
+	/**
+	* @brief 	Find first run of free blocks at or after goal block, or the
+	* 			first run of the disk if none follows it
+	* @param 	list - free block list
+	* @param 	count - number of blocks in run
+	* @param 	goal - block to start searching from
+	* @return 	0 if no run is free, otherwise first block of run
+	*/
+	static uint32_t find_run_near(const char *list, uint32_t count, uint32_t goal)
+	{
+		uint32_t start = ((goal > 1) && (goal < Block_count)) ? find_run(list, count, goal) : 0;
+		return (start != 0) ? start : find_run(list, count);
+	}
+
+	/**
+	* @brief 	Find longest run of free blocks in free block list
+	* @param 	list - free block list
+	* @param 	len - length of run
+	* @return 	0 if no block is free, otherwise first block of run
+	*/
+	static uint32_t longest_run(const char *list, uint32_t *len)
+	{
+		uint32_t best_start = 0;
+		uint32_t start = 0;
+		*len = 0;
+		for (uint32_t i = 1; i <= Block_count; i++)
+		{
+			if ((i < Block_count) && is_free(list, i))
+			{
+				start = (start == 0) ? i : start;
+				continue;
+			}
+
+			if ((start != 0) && (i - start > *len))
+			{
+				best_start = start;
+				*len = i - start;
+			}
+			start = 0;
+		}
+
+		return best_start;
+	}
+};
+
+// Original layout of 128 blocks of 1 KB with 126 inodes in block 0
+typedef Geometry<1024, 128, 126, 5> Legacy_geometry;
+
+// Layout of 1 GB disks with 4 KB blocks
+typedef Geometry<4096, 262144, 65536, 12> Large_geometry;
+
+static_assert(sizeof(Legacy_geometry::Inode) == 8, "Legacy inode must be 8 bytes");
+static_assert(sizeof(Legacy_geometry::Super_block) == Legacy_geometry::BLOCK_SIZE, "Legacy superblock must fill block 0");
+static_assert(sizeof(Legacy_geometry::Block_map) == 128, "Legacy block map must be 128 bytes");
+static_assert(Legacy_geometry::ROOT == 127, "Legacy root directory must be 127");
+static_assert(sizeof(Large_geometry::Inode) == 24, "Large inode must be 24 bytes");
+
+// Geometry of disks handled by the simulator and the block layer. The
+// simulator core keeps uint8_t indices, so it only supports this geometry.
+typedef Legacy_geometry Fs_geometry;
+
+#endif
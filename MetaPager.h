@@ -0,0 +1,131 @@
+#ifndef METAPAGER_H
+#define METAPAGER_H
+
+#include <unistd.h>
+#include <string.h>
+#include <list>
+#include <map>
+#include <vector>
+#include "Geometry.h"
+
+// Default number of metadata blocks held in memory
+#define META_PAGER_PAGES        64
+
+// Superblock of a disk that is read in blocks as they are needed. Mounting
+// only reads the free block list to count its free blocks, and inodes are
+// read from the block of the inode table that holds them. Blocks are kept in
+// least recently used order and the oldest is dropped when more than the
+// given number of blocks are held, so memory does not grow with the number
+// of inodes. Only dumpfs reads disks through it; the simulator loads the
+// whole superblock at mount.
+template <class G>
+class Meta_pager
+{
+public:
+	Meta_pager(int fd, size_t max_pages) : fd(fd), max_pages(max_pages ? max_pages : 1), free_count(0), fault_count(0) {}
+
+	/**
+	* @brief 	Count free blocks of disk without keeping free block list
+	* @return 	0 on success, otherwise -1
+	*/
+	int mount(void)
+	{
+		std::vector<uint8_t> buff(G::BLOCK_SIZE);
+		free_count = 0;
+		for (uint32_t offset = 0; offset < G::FREE_LIST_SIZE; offset += G::BLOCK_SIZE)
+		{
+			uint32_t len = (G::FREE_LIST_SIZE - offset < G::BLOCK_SIZE) ? G::FREE_LIST_SIZE - offset : G::BLOCK_SIZE;
+			if (pread(fd, &buff[0], len, offsetof(typename G::Super_block, free_block_list) + offset) != (ssize_t) len)
+			{
+				return -1;
+			}
+			for (uint32_t i = 0; i < len; i++)
+			{
+				free_count += 8 - __builtin_popcount(buff[i]);
+			}
+		}
+
+		return 0;
+	}
+
+	/**
+	* @brief 	Get inode, reading blocks of inode table that hold it
+	* @param 	index - inode index
+	* @return 	copy of inode
+	*/
+	typename G::Inode inode(uint32_t index)
+	{
+		typename G::Inode inode;
+		uint8_t *dest = (uint8_t *) &inode;
+
+		// Inodes are not aligned to blocks, so one can span two blocks
+		size_t offset = G::INODE_OFFSET + ((size_t) index * sizeof(typename G::Inode));
+		size_t copied = 0;
+		while (copied < sizeof(inode))
+		{
+			size_t block_offset = (offset + copied) % G::BLOCK_SIZE;
+			size_t len = G::BLOCK_SIZE - block_offset;
+			if (len > sizeof(inode) - copied)
+			{
+				len = sizeof(inode) - copied;
+			}
+			memcpy(dest + copied, page((offset + copied) / G::BLOCK_SIZE) + block_offset, len);
+			copied += len;
+		}
+
+		return inode;
+	}
+
+	uint32_t free_blocks(void) const { return free_count; }
+	size_t faults(void) const { return fault_count; }
+	size_t resident(void) const { return pages.size(); }
+
+private:
+	typedef struct {
+		std::vector<uint8_t> data;
+		std::list<uint32_t>::iterator lru_it;
+	} Page;
+
+	/**
+	* @brief 	Get block of superblock, reading it if it is not held
+	* @param 	block_num - block to get
+	* @return 	block data
+	*/
+	const uint8_t *page(uint32_t block_num)
+	{
+		typename std::map<uint32_t, Page>::iterator it = pages.find(block_num);
+		if (it != pages.end())
+		{
+			// Move to most recently used
+			lru.splice(lru.end(), lru, it->second.lru_it);
+			return &it->second.data[0];
+		}
+
+		if (pages.size() >= max_pages)
+		{
+			// Drop least recently used block
+			pages.erase(lru.front());
+			lru.pop_front();
+		}
+
+		Page &new_page = pages[block_num];
+		new_page.data.assign(G::BLOCK_SIZE, 0);
+		new_page.lru_it = lru.insert(lru.end(), block_num);
+		if (pread(fd, &new_page.data[0], G::BLOCK_SIZE, (off_t) block_num * G::BLOCK_SIZE) < 0)
+		{
+			memset(&new_page.data[0], 0, G::BLOCK_SIZE);
+		}
+		fault_count++;
+
+		return &new_page.data[0];
+	}
+
+	int fd;
+	size_t max_pages;
+	uint32_t free_count;
+	size_t fault_count;
+	std::map<uint32_t, Page> pages;
+	std::list<uint32_t> lru;  // Held blocks, least recently used first
+};
+
+#endif
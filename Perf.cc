@@ -0,0 +1,145 @@
+#include "Perf.h"
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+// File descriptor of each counter, -1 if it could not be opened
+int perf_fd[PERF_COUNTERS] = {-1, -1, -1, -1, -1, -1, -1};
+
+// Counters whose ratio is printed are opened as one group, so the kernel
+// schedules them on the PMU together and both cover the same time when the
+// PMU has to multiplex. Group leader of each counter, as asked for.
+const int perf_leader[PERF_COUNTERS] = {PERF_TASK_CLOCK, PERF_CYCLES, PERF_CYCLES, PERF_CACHE_REFERENCES,
+	PERF_CACHE_REFERENCES, PERF_BRANCHES, PERF_BRANCHES};
+
+// Group leader each counter was opened with, itself if its leader failed
+int perf_group[PERF_COUNTERS];
+
+
+/**
+* @brief 	Open counter of calling thread on any processor
+* @param 	type - PERF_TYPE_HARDWARE or PERF_TYPE_SOFTWARE
+* @param 	config - event of type
+* @param 	group_fd - file descriptor of group leader, -1 to lead a group
+* @return 	file descriptor, -1 if counter is not available
+*/
+int perf_open_counter(uint32_t type, uint64_t config, int group_fd)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_hv = 1;
+
+	// Whole group is read at once, with the time it was enabled and the
+	// time it was on the PMU to scale counts when multiplexed
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+	if ((fd < 0) && (errno == EACCES))
+	{
+		// Unprivileged processes may only count user space
+		attr.exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+	}
+
+	return fd;
+}
+
+
+/**
+* @brief 	Open every counter the kernel and processor provide, skipping
+* 			the others, as in containers and virtual machines without a PMU
+* @return 	number of counters opened
+*/
+int perf_open(void)
+{
+	const uint64_t hardware[PERF_COUNTERS] = {0, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES};
+
+	int opened = 0;
+	for (int i = 0; i < PERF_COUNTERS; i++)
+	{
+		// Leader comes first, a counter whose leader failed leads its own group
+		perf_group[i] = ((perf_leader[i] != i) && (perf_fd[perf_leader[i]] >= 0)) ? perf_leader[i] : i;
+		int group_fd = (perf_group[i] != i) ? perf_fd[perf_group[i]] : -1;
+		perf_fd[i] = (i == PERF_TASK_CLOCK) ? perf_open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, group_fd) :
+			perf_open_counter(PERF_TYPE_HARDWARE, hardware[i], group_fd);
+		opened += (perf_fd[i] >= 0);
+	}
+
+	return opened;
+}
+
+
+/**
+* @brief 	Check if counter was opened
+* @param 	counter - Perf_counter
+* @return 	1 if counter is counting, otherwise 0
+*/
+uint8_t perf_available(int counter)
+{
+	return perf_fd[counter] >= 0;
+}
+
+
+/**
+* @brief 	Read running totals of counters, scaled up for the time their
+* 			group was not on the PMU
+* @param 	values - total of each counter, 0 for counters not opened
+*/
+void perf_read(uint64_t values[PERF_COUNTERS])
+{
+	for (int i = 0; i < PERF_COUNTERS; i++)
+	{
+		values[i] = 0;
+	}
+
+	for (int i = 0; i < PERF_COUNTERS; i++)
+	{
+		if ((perf_fd[i] < 0) || (perf_group[i] != i))
+		{
+			continue;
+		}
+
+		// Number of counters, time enabled, time running, then the count of
+		// each counter in the order they joined the group
+		uint64_t data[3 + PERF_COUNTERS];
+		ssize_t len = read(perf_fd[i], data, sizeof(data));
+		if ((len < (ssize_t) (3 * sizeof(uint64_t))) || (data[2] == 0))
+		{
+			continue;
+		}
+
+		double scale = (double) data[1] / data[2];
+		uint64_t member = 0;
+		for (int j = i; (j < PERF_COUNTERS) && (member < data[0]); j++)
+		{
+			if ((perf_fd[j] >= 0) && (perf_group[j] == i))
+			{
+				values[j] = (uint64_t) (data[3 + member] * scale);
+				member++;
+			}
+		}
+	}
+}
+
+
+/**
+* @brief 	Close every counter
+*/
+void perf_close(void)
+{
+	for (int i = 0; i < PERF_COUNTERS; i++)
+	{
+		if (perf_fd[i] >= 0)
+		{
+			close(perf_fd[i]);
+			perf_fd[i] = -1;
+		}
+	}
+}
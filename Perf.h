@@ -0,0 +1,23 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+// Counters read around each command, of the thread that opened them
+enum Perf_counter {
+	PERF_TASK_CLOCK,        // CPU time in ns, counted by the kernel without hardware counters
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_REFERENCES,
+	PERF_CACHE_MISSES,
+	PERF_BRANCHES,
+	PERF_BRANCH_MISSES,
+	PERF_COUNTERS
+};
+
+int perf_open(void);
+uint8_t perf_available(int counter);
+void perf_read(uint64_t values[PERF_COUNTERS]);
+void perf_close(void);
+
+#endif
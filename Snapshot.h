@@ -0,0 +1,136 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Immutable versions of a value, published by a single writer thread and
+// read by other threads without locks. The writer never changes a published
+// version, it builds the next one and swaps it in with publish(). A reader
+// holds a pin on the version it reads, taken with pin() by the writer when it
+// hands the read off, so the reader sees the value as of that point in the
+// writer's history and releases it with unpin() when done. Replaced versions
+// are retired with the epoch they were replaced in and deleted by the writer
+// once every pin was taken in a later epoch.
+template <typename T, size_t Pins>
+class Snapshot_domain
+{
+public:
+	Snapshot_domain() : current(NULL), epoch(1)
+	{
+		for (size_t i = 0; i < Pins; i++)
+		{
+			pins[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	~Snapshot_domain()
+	{
+		for (size_t i = 0; i < retired.size(); i++)
+		{
+			delete retired[i].version;
+		}
+		delete current.load(std::memory_order_relaxed);
+	}
+
+	/**
+	* @brief 	Pin current version for a reader, waiting while every pin is
+	* 			held
+	* @param 	pin_index - pin that will be released with unpin()
+	* @return 	current version, NULL if none was published
+	*/
+	const T *pin(size_t *pin_index)
+	{
+		while (1)
+		{
+			for (size_t i = 0; i < Pins; i++)
+			{
+				uint64_t expected = 0;
+				if (pins[i].compare_exchange_strong(expected, epoch.load()))
+				{
+					*pin_index = i;
+					return current.load();
+				}
+			}
+
+			// Readers release pins as they finish
+			collect();
+			std::this_thread::yield();
+		}
+	}
+
+	/**
+	* @brief 	Release pin once reader no longer uses its version
+	* @param 	pin_index - pin returned by pin()
+	*/
+	void unpin(size_t pin_index)
+	{
+		pins[pin_index].store(0, std::memory_order_release);
+	}
+
+	/**
+	* @brief 	Replace current version and delete retired versions that are
+	* 			no longer pinned
+	* @param 	next - new version, owned by domain from now on
+	*/
+	void publish(T *next)
+	{
+		T *old = current.exchange(next);
+		if (old != NULL)
+		{
+			Retired entry = {old, epoch.load()};
+			retired.push_back(entry);
+		}
+		epoch.fetch_add(1);
+
+		collect();
+	}
+
+	/**
+	* @brief 	Delete retired versions older than every pin
+	*/
+	void collect(void)
+	{
+		uint64_t oldest = UINT64_MAX;
+		for (size_t i = 0; i < Pins; i++)
+		{
+			uint64_t pinned = pins[i].load(std::memory_order_acquire);
+			if ((pinned != 0) && (pinned < oldest))
+			{
+				oldest = pinned;
+			}
+		}
+
+		size_t kept = 0;
+		for (size_t i = 0; i < retired.size(); i++)
+		{
+			if (retired[i].epoch < oldest)
+			{
+				delete retired[i].version;
+			}
+			else
+			{
+				retired[kept++] = retired[i];
+			}
+		}
+		retired.resize(kept);
+	}
+
+	size_t retired_count(void) const { return retired.size(); }
+
+private:
+	typedef struct {
+		T *version;
+		uint64_t epoch;  // Epoch version was replaced in
+	} Retired;
+
+	std::atomic<T *> current;
+	std::atomic<uint64_t> epoch;
+	std::atomic<uint64_t> pins[Pins];  // Epoch each pin was taken in, 0 if free
+	std::vector<Retired> retired;      // Only used by writer
+};
+
+#endif
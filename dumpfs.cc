@@ -0,0 +1,249 @@
+#include "FileSystem.h"
+#include "MetaPager.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+// Max blocks of a contiguous file copied with one read and one write
+#define DUMPFS_CHUNK_BLOCKS     256
+
+
+/**
+* @brief 	Check if parents of inode lead to root directory
+* @param 	pager - superblock of disk
+* @param 	inode_index - index of inode
+* @return 	1 if inode is below root directory, 2 if it is below a directory
+* 			detached with -r and not yet reclaimed, 0 if a parent is invalid
+* 			or directories are parents of each other
+*/
+template <class G>
+uint8_t dumpfs_reachable(Meta_pager<G> &pager, uint32_t inode_index)
+{
+	uint32_t dir = inode_index;
+	for (uint32_t steps = 0; steps <= G::INODE_COUNT; steps++)
+	{
+		if (dir == G::ROOT)
+		{
+			return 1;
+		}
+
+		if ((dir >= G::INODE_COUNT) || ((pager.inode(dir).used_size & G::FLAG) == 0))
+		{
+			return 0;
+		}
+
+		// Parent one past the last inode marks a detached directory
+		typename G::Inode inode = pager.inode(dir);
+		if (((inode.dir_parent & G::MASK) == G::INODE_COUNT) && (inode.dir_parent & G::FLAG))
+		{
+			return 2;
+		}
+		dir = inode.dir_parent & G::MASK;
+	}
+
+	return 0;
+}
+
+
+/**
+* @brief 	Get host path of inode
+* @param 	pager - superblock of disk
+* @param 	host_dir - host directory that disk root directory maps to
+* @param 	inode_index - index of inode
+* @return 	host path
+*/
+template <class G>
+std::string dumpfs_path(Meta_pager<G> &pager, const std::string &host_dir, uint32_t inode_index)
+{
+	typename G::Inode inode = pager.inode(inode_index);
+	uint32_t parent = inode.dir_parent & G::MASK;
+
+	char name[G::NAME_LEN + 1];
+	strncpy(name, inode.name, G::NAME_LEN);
+	name[G::NAME_LEN] = 0;
+
+	if (parent == G::ROOT)
+	{
+		return host_dir + "/" + name;
+	}
+
+	return dumpfs_path(pager, host_dir, parent) + "/" + name;
+}
+
+
+/**
+* @brief 	Create host directory of directory inode and of its parents
+* @param 	pager - superblock of disk
+* @param 	host_dir - host directory that disk root directory maps to
+* @param 	inode_index - index of directory inode
+*/
+template <class G>
+void dumpfs_mkdir(Meta_pager<G> &pager, const std::string &host_dir, uint32_t inode_index)
+{
+	// Parents can have higher inode indexes than their children
+	uint32_t parent = pager.inode(inode_index).dir_parent & G::MASK;
+	if (parent != G::ROOT)
+	{
+		dumpfs_mkdir(pager, host_dir, parent);
+	}
+
+	mkdir(dumpfs_path(pager, host_dir, inode_index).c_str(), 0755);
+}
+
+
+/**
+* @brief 	Recreate directory tree of disk of given geometry on host
+* @param 	fd - file descriptor of disk
+* @param 	disk - name of disk
+* @param 	host_dir - host directory that disk root directory maps to
+* @param 	max_pages - max number of superblock blocks held in memory
+* @return 	0 on success, otherwise -1
+*/
+template <class G>
+int dumpfs_export(int fd, const char *disk, const std::string &host_dir, size_t max_pages)
+{
+	// Only the free block list is read up front
+	Meta_pager<G> pager(fd, max_pages);
+	if (pager.mount() < 0)
+	{
+		fprintf(stderr, "Error: Cannot read superblock of %s\n", disk);
+		return -1;
+	}
+
+	mkdir(host_dir.c_str(), 0755);
+
+	// Paths are only built for inodes whose parents lead to root directory,
+	// inodes below detached directories are pending deletes and are skipped
+	std::vector<uint8_t> reachable(G::INODE_COUNT, 0);
+	for (uint32_t i = 0; i < G::INODE_COUNT; i++)
+	{
+		typename G::Inode inode = pager.inode(i);
+		if ((inode.used_size & G::FLAG) == 0)
+		{
+			continue;
+		}
+
+		reachable[i] = dumpfs_reachable(pager, i);
+		if (reachable[i] == 2)
+		{
+			reachable[i] = 0;
+		}
+		else if (reachable[i] == 0)
+		{
+			fprintf(stderr, "Error: Inode %u of %s is not below the root directory\n", i, disk);
+		}
+	}
+
+	for (uint32_t i = 0; i < G::INODE_COUNT; i++)
+	{
+		typename G::Inode inode = pager.inode(i);
+		if (reachable[i] && (inode.dir_parent & G::FLAG))
+		{
+			dumpfs_mkdir(pager, host_dir, i);
+		}
+	}
+
+	for (uint32_t i = 0; i < G::INODE_COUNT; i++)
+	{
+		typename G::Inode inode = pager.inode(i);
+		if ((reachable[i] == 0) || (inode.dir_parent & G::FLAG))
+		{
+			continue;
+		}
+
+		std::string path = dumpfs_path(pager, host_dir, i);
+		int host_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (host_fd < 0)
+		{
+			fprintf(stderr, "Error: Cannot create %s\n", path.c_str());
+			continue;
+		}
+
+		uint32_t size = inode.used_size & G::MASK;
+		if (size > 0)
+		{
+			// Contiguous file is copied with one read and one write per chunk
+			std::vector<uint8_t> buff(((size < DUMPFS_CHUNK_BLOCKS) ? size : DUMPFS_CHUNK_BLOCKS) * G::BLOCK_SIZE);
+			for (uint32_t block = 0; block < size; block += DUMPFS_CHUNK_BLOCKS)
+			{
+				uint32_t count = (size - block < DUMPFS_CHUNK_BLOCKS) ? size - block : DUMPFS_CHUNK_BLOCKS;
+				ssize_t len = pread(fd, &buff[0], count * G::BLOCK_SIZE, (off_t) (inode.start_block + block) * G::BLOCK_SIZE);
+				if (len <= 0)
+				{
+					break;
+				}
+				write(host_fd, &buff[0], len);
+			}
+		}
+		else
+		{
+			// Unwritten blocks of mapped file are left as holes in host file
+			typename G::Block_map map;
+			uint8_t buff[G::BLOCK_SIZE];
+			pread(fd, &map, sizeof(map), (off_t) inode.start_block * G::BLOCK_SIZE);
+			uint32_t map_size = map.size & G::MASK;
+			for (uint32_t j = 0; (j < map_size) && (j < G::MAP_ENTRIES); j++)
+			{
+				if ((map.block[j] != 0) && (pread(fd, buff, sizeof(buff), (off_t) map.block[j] * G::BLOCK_SIZE) == sizeof(buff)))
+				{
+					pwrite(host_fd, buff, sizeof(buff), (off_t) j * G::BLOCK_SIZE);
+				}
+			}
+			ftruncate(host_fd, (off_t) map_size * G::BLOCK_SIZE);
+		}
+
+		close(host_fd);
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	// Legacy geometry unless -g large is given
+	int large = 0;
+	size_t max_pages = META_PAGER_PAGES;
+	int opt;
+	while ((opt = getopt(argc, argv, "g:m:")) != -1)
+	{
+		if ((opt == 'g') && ((strcmp(optarg, "large") == 0) || (strcmp(optarg, "legacy") == 0)))
+		{
+			large = (optarg[1] == 'a');
+		}
+		else if ((opt == 'm') && (atoi(optarg) > 0))
+		{
+			max_pages = atoi(optarg);
+		}
+		else
+		{
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	if (argc - optind != 2)
+	{
+		fprintf(stderr, "Usage: %s [-g legacy|large] [-m <blocks>] <disk> <host directory>\n", argv[0]);
+		return -1;
+	}
+
+	const char *disk = argv[optind];
+	int fd = open(disk, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error: Cannot find disk %s\n", disk);
+		return -1;
+	}
+
+	int ret = large ? dumpfs_export<Large_geometry>(fd, disk, argv[optind + 1], max_pages) :
+		dumpfs_export<Legacy_geometry>(fd, disk, argv[optind + 1], max_pages);
+	close(fd);
+
+	return ret;
+}
@@ -0,0 +1,162 @@
+#include "BlockIO.h"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+// Number of hot blocks to report
+#define HOT_BLOCKS              10
+
+// Disk accesses of one command type
+typedef struct {
+	std::set<uint32_t> lines;  // Lines the command made disk accesses on
+	uint64_t runs;             // Commands run, from command records
+	uint64_t reads;
+	uint64_t read_bytes;
+	uint64_t writes;
+	uint64_t write_bytes;
+	uint64_t seeks;
+	uint64_t seek_bytes;
+} Command_stats;
+
+
+/**
+* @brief 	Get bytes of file data a command asks to write
+* @param 	command - command name
+* @return 	bytes of file data written by one command
+*/
+uint64_t iotrace_logical_bytes(const std::string &command)
+{
+	if ((command == "W") || (command == "hwrite"))
+	{
+		return IO_BLOCK_SIZE;
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s <trace>\n", argv[0]);
+		return -1;
+	}
+
+	FILE *fp = fopen(argv[1], "rb");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Error: Cannot open trace %s\n", argv[1]);
+		return -1;
+	}
+
+	char magic[8];
+	if ((fread(magic, 1, 8, fp) != 8) || (memcmp(magic, IO_TRACE_MAGIC, 8) != 0))
+	{
+		fprintf(stderr, "Error: %s is not an I/O trace\n", argv[1]);
+		fclose(fp);
+		return -1;
+	}
+
+	std::map<std::string, Command_stats> commands;
+	std::map<uint32_t, uint64_t> block_accesses;
+
+	// Seek distances in blocks, bucketed by powers of two
+	const char *bucket_names[] = {"0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+"};
+	uint64_t buckets[8] = {0};
+
+	Io_record record;
+	while (fread(&record, sizeof(Io_record), 1, fp) == 1)
+	{
+		std::string command(record.command, strnlen(record.command, 7));
+		Command_stats *stats = &commands[command];
+		if (record.op == IO_TRACE_COMMAND)
+		{
+			stats->runs++;
+			continue;
+		}
+		stats->lines.insert(record.line);
+
+		if (record.op == IO_TRACE_SEEK)
+		{
+			stats->seeks++;
+			stats->seek_bytes += record.length;
+
+			uint32_t distance = record.length / IO_BLOCK_SIZE;
+			uint8_t bucket = 0;
+			while ((distance > 0) && (bucket < 7))
+			{
+				distance >>= 1;
+				bucket++;
+			}
+			buckets[bucket]++;
+			continue;
+		}
+
+		if (record.op == IO_TRACE_READ)
+		{
+			stats->reads++;
+			stats->read_bytes += record.length;
+		}
+		else
+		{
+			// Writes to an overlay delta count as writes of the command
+			stats->writes++;
+			stats->write_bytes += record.length;
+		}
+
+		for (uint32_t block = record.offset / IO_BLOCK_SIZE; block * IO_BLOCK_SIZE < record.offset + record.length; block++)
+		{
+			block_accesses[block]++;
+		}
+	}
+	fclose(fp);
+
+	printf("%-8s %6s %6s %9s %6s %9s %9s %6s\n", "command", "count", "reads", "read B", "writes", "write B", "B/cmd", "amp");
+	for (std::map<std::string, Command_stats>::iterator it = commands.begin(); it != commands.end(); it++)
+	{
+		Command_stats *stats = &it->second;
+		// Accesses made for a command without command records, such as
+		// reclaim, are counted by line
+		uint64_t count = (stats->runs > 0) ? stats->runs : stats->lines.size();
+		uint64_t logical = iotrace_logical_bytes(it->first) * count;
+
+		char amp[16] = "-";
+		if (logical > 0)
+		{
+			// Physical bytes written per byte of file data written
+			snprintf(amp, sizeof(amp), "%.2f", (double) stats->write_bytes / logical);
+		}
+
+		printf("%-8s %6llu %6llu %9llu %6llu %9llu %9llu %6s\n", it->first.c_str(), (unsigned long long) count,
+			(unsigned long long) stats->reads, (unsigned long long) stats->read_bytes,
+			(unsigned long long) stats->writes, (unsigned long long) stats->write_bytes,
+			(unsigned long long) (stats->write_bytes / count), amp);
+	}
+
+	printf("\nseek distance (blocks)\n");
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		printf("%-8s %9llu\n", bucket_names[i], (unsigned long long) buckets[i]);
+	}
+
+	// Blocks sorted by number of accesses, most accessed first
+	std::vector< std::pair<uint64_t, uint32_t> > hot;
+	for (std::map<uint32_t, uint64_t>::iterator it = block_accesses.begin(); it != block_accesses.end(); it++)
+	{
+		hot.push_back(std::make_pair(it->second, it->first));
+	}
+	std::sort(hot.rbegin(), hot.rend());
+
+	printf("\nhot blocks\n");
+	for (size_t i = 0; (i < hot.size()) && (i < HOT_BLOCKS); i++)
+	{
+		printf("%-8u %9llu\n", hot[i].second, (unsigned long long) hot[i].first);
+	}
+
+	return 0;
+}
@@ -0,0 +1,243 @@
+#include "FileSystem.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Host file or directory to copy into disk
+typedef struct {
+	std::string path;     // Path of entry on host
+	std::string name;     // Name of entry on disk
+	uint32_t parent;      // Index of parent inode, root index for root directory
+	uint8_t is_dir;
+	uint32_t size;        // Size of file in blocks
+	uint32_t start_block; // Start block of file on disk
+	off_t bytes;          // Size of file on host
+} Entry;
+
+
+/**
+* @brief 	Add entries of host directory to list, directories recursively
+* @param 	host_dir - path of host directory
+* @param 	parent - index of inode of host directory
+* @param 	entries - list of entries, index of entry is its inode index
+* @return 	0 on success, otherwise -1
+*/
+template <class G>
+int mkfs_scan(std::string host_dir, uint32_t parent, std::vector<Entry> &entries)
+{
+	DIR *dir = opendir(host_dir.c_str());
+	if (dir == NULL)
+	{
+		fprintf(stderr, "Error: Cannot open directory %s\n", host_dir.c_str());
+		return -1;
+	}
+
+	// Sort names so the same tree always gives the same disk
+	std::vector<std::string> names;
+	struct dirent *dirent;
+	while ((dirent = readdir(dir)) != NULL)
+	{
+		if ((strcmp(dirent->d_name, ".") != 0) && (strcmp(dirent->d_name, "..") != 0))
+		{
+			names.push_back(dirent->d_name);
+		}
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+
+	std::vector<uint32_t> sub_dirs;
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		Entry entry;
+		entry.path = host_dir + "/" + names[i];
+
+		struct stat st;
+		if (lstat(entry.path.c_str(), &st) < 0)
+		{
+			fprintf(stderr, "Error: Cannot stat %s\n", entry.path.c_str());
+			return -1;
+		}
+
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+		{
+			// Links and special files have no equivalent on disk
+			fprintf(stderr, "Error: %s is not a file or directory\n", entry.path.c_str());
+			return -1;
+		}
+
+		if (names[i].length() > G::NAME_LEN)
+		{
+			fprintf(stderr, "Error: Name of %s is longer than %u characters\n", entry.path.c_str(), G::NAME_LEN);
+			return -1;
+		}
+
+		if (entries.size() >= G::INODE_COUNT)
+		{
+			fprintf(stderr, "Error: Superblock is full, cannot create %s\n", names[i].c_str());
+			return -1;
+		}
+
+		entry.name = names[i];
+		entry.parent = parent;
+		entry.is_dir = S_ISDIR(st.st_mode);
+		entry.bytes = entry.is_dir ? 0 : st.st_size;
+		entry.start_block = 0;
+		entry.size = 0;
+
+		if (!entry.is_dir)
+		{
+			// Empty files still need one block since size 0 marks a directory
+			off_t size = (st.st_size + G::BLOCK_SIZE - 1) / G::BLOCK_SIZE;
+			if (size > G::MAX_FILE_BLOCKS)
+			{
+				fprintf(stderr, "Error: File %s is larger than %u blocks\n", entry.path.c_str(), G::MAX_FILE_BLOCKS);
+				return -1;
+			}
+			entry.size = (size > 0) ? size : 1;
+		}
+		else
+		{
+			sub_dirs.push_back(entries.size());
+		}
+
+		entries.push_back(entry);
+	}
+
+	// Directories are scanned after their siblings so siblings share a run of inodes
+	for (size_t i = 0; i < sub_dirs.size(); i++)
+	{
+		if (mkfs_scan<G>(entries[sub_dirs[i]].path, sub_dirs[i], entries) < 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+* @brief 	Build disk of given geometry from host directory tree
+* @param 	host_dir - path of host directory
+* @param 	disk - name of disk to create
+* @return 	0 on success, otherwise -1
+*/
+template <class G>
+int mkfs_build(const char *host_dir, const char *disk)
+{
+	// Plan inodes and block layout before writing anything
+	std::vector<Entry> entries;
+	if (mkfs_scan<G>(host_dir, G::ROOT, entries) < 0)
+	{
+		return -1;
+	}
+
+	// Superblock of large geometries spans several blocks
+	std::vector<uint8_t> sb_buff(G::SUPER_BLOCKS * G::BLOCK_SIZE, 0);
+	typename G::Super_block &sb = *(typename G::Super_block *) &sb_buff[0];
+
+	// Files are placed back to back in inode order
+	uint32_t next_block = G::SUPER_BLOCKS;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		Entry *entry = &entries[i];
+		typename G::Inode *inode = &sb.inode[i];
+
+		if (!entry->is_dir)
+		{
+			if (next_block + entry->size > G::BLOCK_COUNT)
+			{
+				fprintf(stderr, "Error: Cannot allocate %u for %s\n", entry->size, entry->path.c_str());
+				return -1;
+			}
+			entry->start_block = next_block;
+			next_block += entry->size;
+		}
+
+		strncpy(inode->name, entry->name.c_str(), G::NAME_LEN);
+		inode->used_size = G::FLAG | entry->size;
+		inode->start_block = entry->start_block;
+		inode->dir_parent = (entry->is_dir ? G::FLAG : 0) | entry->parent;
+	}
+
+	// Superblock and every allocated block are marked used
+	G::set_blocks(sb.free_block_list, 0, next_block - 1, 1);
+
+	int fd = open(disk, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error: Cannot create disk %s\n", disk);
+		return -1;
+	}
+
+	// Stream superblock and file data to disk in block order
+	write(fd, &sb_buff[0], sb_buff.size());
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		Entry *entry = &entries[i];
+		if (entry->is_dir)
+		{
+			continue;
+		}
+
+		std::vector<uint8_t> buff(entry->size * G::BLOCK_SIZE, 0);
+		int host_fd = open(entry->path.c_str(), O_RDONLY);
+		if ((host_fd < 0) || (read(host_fd, &buff[0], entry->bytes) != entry->bytes))
+		{
+			fprintf(stderr, "Error: Cannot read %s\n", entry->path.c_str());
+			close(fd);
+			return -1;
+		}
+		close(host_fd);
+
+		write(fd, &buff[0], buff.size());
+	}
+
+	// Remaining blocks are empty
+	if (ftruncate(fd, (off_t) G::BLOCK_COUNT * G::BLOCK_SIZE) < 0)
+	{
+		fprintf(stderr, "Error: Cannot resize disk %s\n", disk);
+	}
+	close(fd);
+
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	// Legacy geometry unless -g large is given
+	int large = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "g:")) != -1)
+	{
+		if ((opt == 'g') && (strcmp(optarg, "large") == 0))
+		{
+			large = 1;
+		}
+		else if ((opt != 'g') || (strcmp(optarg, "legacy") != 0))
+		{
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	if (argc - optind != 2)
+	{
+		fprintf(stderr, "Usage: %s [-g legacy|large] <host directory> <disk>\n", argv[0]);
+		return -1;
+	}
+
+	if (large)
+	{
+		return mkfs_build<Large_geometry>(argv[optind], argv[optind + 1]);
+	}
+	return mkfs_build<Legacy_geometry>(argv[optind], argv[optind + 1]);
+}
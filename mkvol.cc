@@ -0,0 +1,121 @@
+#include "BlockIO.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+
+/**
+* @brief 	Get path of member as written in volume descriptor
+* @param 	descriptor - path of volume descriptor
+* @param 	member - path of member
+* @return 	name of member if it is next to descriptor, otherwise its full path
+*/
+std::string mkvol_member_path(const std::string &descriptor, const std::string &member)
+{
+	std::string descriptor_dir = descriptor.substr(0, descriptor.find_last_of('/') + 1);
+	std::string member_dir = member.substr(0, member.find_last_of('/') + 1);
+	if (member_dir == descriptor_dir)
+	{
+		return member.substr(member_dir.size());
+	}
+
+	char *full_path = realpath(member.c_str(), NULL);
+	std::string path = (full_path != NULL) ? full_path : member;
+	free(full_path);
+	return path;
+}
+
+
+int main(int argc, char **argv)
+{
+	uint32_t stripe = IO_STRIPE_BLOCKS;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:")) != -1)
+	{
+		if ((opt == 's') && (atoi(optarg) > 0) && (atoi(optarg) <= (int) IO_BLOCK_COUNT))
+		{
+			stripe = atoi(optarg);
+		}
+		else
+		{
+			optind = argc + 1;
+			break;
+		}
+	}
+
+	int member_count = argc - optind - 2;
+	if ((member_count < 1) || (member_count > IO_MAX_MEMBERS))
+	{
+		fprintf(stderr, "Usage: %s [-s <stripe blocks>] <disk> <volume descriptor> <member>...\n", argv[0]);
+		return -1;
+	}
+
+	const char *disk = argv[optind];
+	int fd = open(disk, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error: Cannot find disk %s\n", disk);
+		return -1;
+	}
+
+	std::vector<int> members;
+	for (int i = 0; i < member_count; i++)
+	{
+		const char *name = argv[optind + 2 + i];
+		int member_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (member_fd < 0)
+		{
+			fprintf(stderr, "Error: Cannot create member %s\n", name);
+			return -1;
+		}
+		members.push_back(member_fd);
+	}
+
+	// Each stripe unit of disk is copied to the member it is dealt to
+	std::vector<uint8_t> buff(stripe * IO_BLOCK_SIZE);
+	for (uint32_t block = 0; block < IO_BLOCK_COUNT; block += stripe)
+	{
+		size_t len = ((IO_BLOCK_COUNT - block < stripe) ? IO_BLOCK_COUNT - block : stripe) * IO_BLOCK_SIZE;
+		ssize_t read_len = pread(fd, &buff[0], len, (off_t) block * IO_BLOCK_SIZE);
+		if (read_len < (ssize_t) len)
+		{
+			memset(&buff[(read_len > 0) ? read_len : 0], 0, len - ((read_len > 0) ? read_len : 0));
+		}
+
+		size_t member;
+		off_t offset = io_stripe_map((off_t) block * IO_BLOCK_SIZE, stripe, members.size(), &member);
+		if (pwrite(members[member], &buff[0], len, offset) != (ssize_t) len)
+		{
+			fprintf(stderr, "Error: Cannot write member %s\n", argv[optind + 2 + member]);
+			return -1;
+		}
+	}
+	close(fd);
+
+	for (size_t i = 0; i < members.size(); i++)
+	{
+		close(members[i]);
+	}
+
+	std::string descriptor = argv[optind + 1];
+	FILE *fp = fopen(descriptor.c_str(), "w");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Error: Cannot create volume descriptor %s\n", descriptor.c_str());
+		return -1;
+	}
+	fprintf(fp, "%s\nstripe %u\n", IO_VOLUME_MAGIC, stripe);
+	for (int i = 0; i < member_count; i++)
+	{
+		fprintf(fp, "member %s\n", mkvol_member_path(descriptor, argv[optind + 2 + i]).c_str());
+	}
+	fclose(fp);
+
+	return 0;
+}